@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
 #include "llsim.h"
 
 /*
@@ -8,6 +11,111 @@
  */
 llsim_t *llsim = NULL;
 static int stop_sim = 0;
+static int llsim_argc = 0;
+static char **llsim_argv = NULL;
+
+/*
+ * logging and flight recorder
+ */
+#define LLSIM_FLIGHT_MAX_ARGS 8
+
+typedef struct llsim_flight_record_s {
+	int clock;
+	int category;
+	const char *fmt;
+	int nr_args;
+	long long args[LLSIM_FLIGHT_MAX_ARGS];	// %s arguments are kept as pointers
+} llsim_flight_record_t;
+
+int llsim_log_levels[LLSIM_NR_LOG_CATEGORIES] = {LLSIM_LOG_DEBUG, LLSIM_LOG_DEBUG, LLSIM_LOG_DEBUG, LLSIM_LOG_DEBUG};
+static char *llsim_log_category_names[LLSIM_NR_LOG_CATEGORIES] = {"log_sim", "log_clock", "log_mem", "log_unit"};
+static llsim_flight_record_t *flight_records = NULL;
+static int flight_size = 0;
+static int flight_next = 0;
+static int flight_count = 0;
+static int flight_cycles = 0;
+static volatile sig_atomic_t flight_dump_requested = 0;
+
+/*
+ * generic register tracing, driven by the llsim_register_register metadata
+ */
+static FILE *reg_trace_fp = NULL;	// binary, changed registers packed to their width
+static FILE *reg_diff_fp = NULL;	// text, one line per changed register
+static int nr_traced_registers = 0;
+static int reg_trace_started = 0;
+static unsigned char *reg_trace_buf = NULL;
+
+/*
+ * VCD waveform of the selected registers inside the [vcd_start, vcd_end] clock window
+ */
+static FILE *vcd_fp = NULL;
+static int vcd_is_pipe = 0;		// written through gzip
+static int vcd_start = 0;
+static int vcd_end = -1;		// -1: until the end of the simulation
+static int vcd_started = 0;
+static char *vcd_selected = NULL;	// per register index
+static int *vcd_values = NULL;		// last dumped value per register index
+
+static void llsim_trace_registers(void);
+static void llsim_vcd_clock(void);
+
+/*
+ * rolling hash of all registers and memory writes, checkpointed every hash_interval clocks
+ */
+#define LLSIM_HASH_PRIME 0x100000001b3ULL
+#define llsim_hash_mix(h, v) (((h) ^ (unsigned int) (v)) * LLSIM_HASH_PRIME)
+
+static FILE *hash_fp = NULL;
+static int hash_interval = 0;
+static unsigned long long state_hash = 0xcbf29ce484222325ULL;
+
+static void llsim_hash_clock(void);
+
+/*
+ * snapshots of all registers and of per page memory hashes, for bisecting two runs
+ */
+static FILE *snapshot_fp = NULL;
+static int snapshot_interval = 0;
+static int snapshot_start = 0;
+static int snapshot_end = -1;		// -1: until the end of the simulation
+static int snapshot_page = 0;		// words per hashed memory page
+
+static void llsim_snapshot_clock(void);
+
+/*
+ * watchdog: cycle budget, and detection of a machine state that repeats forever.
+ * The state is the registers (but the watchdog_ignore ones, e.g. free running
+ * counters), pending memory reads and the memory contents, hashed incrementally
+ */
+static int max_cycles = 0;
+static int watchdog_period = 0;		// longest detected loop, in clocks
+static char *watchdog_ignore = NULL;
+static unsigned long long *watchdog_ring = NULL;	// state hash of the last watchdog_period clocks
+static unsigned long long watchdog_saved = 0;	// Brent's cycle detection
+static int watchdog_saved_clock = 0;
+static int watchdog_power = 1;
+static int watchdog_loop = 0;		// candidate loop period
+static int watchdog_loop_clock = 0;	// clock the candidate loop was seen
+static unsigned long long mem_state_hash = 0;
+
+// keyed by the storage, the ports of a shared memory write the same words
+#define llsim_watchdog_word(mem, addr, val) \
+	llsim_hash_mix(llsim_hash_mix(llsim_hash_mix(0xcbf29ce484222325ULL, (long) (mem)->data), (addr)), (val))
+
+static void llsim_watchdog_clock(void);
+
+/*
+ * threaded clock engine. Units only read old registers and write new ones, so the units
+ * of a clock run on llsim_threads threads, unit i on thread i % llsim_threads. The main
+ * thread then serves the memory requests in unit order and copies the registers
+ */
+static int llsim_threads = 1;
+static llsim_unit_t **unit_table = NULL;	// the units in list order
+static int nr_units = 0;
+static pthread_t *workers = NULL;
+static pthread_barrier_t clock_start, clock_done;
+static int workers_exit = 0;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void *llsim_malloc(int len)
 {
@@ -19,6 +127,153 @@ void *llsim_malloc(int len)
 	return p;
 }
 
+/*
+ * number of 'l' length modifiers of the conversion from % to conv, 0 for int, 1 for
+ * long and 2 for long long
+ */
+static int llsim_flight_longs(const char *p, const char *conv)
+{
+	int n = 0;
+
+	for (; p < conv; p++)
+		n += *p == 'l';
+	return n;
+}
+
+/*
+ * records the message in the flight recorder and prints it if its category level allows.
+ * Only int, long, long long and string arguments are supported
+ */
+void llsim_log_event(int category, int level, const char *fmt, ...)
+{
+	llsim_flight_record_t *rec;
+	const char *p, *conv;
+	va_list ap;
+
+	if (llsim_threads > 1)
+		pthread_mutex_lock(&log_mutex);
+	if (flight_records) {
+		rec = &flight_records[flight_next];
+		rec->clock = llsim ? llsim->clock : 0;
+		rec->category = category;
+		rec->fmt = fmt;
+		rec->nr_args = 0;
+		va_start(ap, fmt);
+		for (p = strchr(fmt, '%'); p && rec->nr_args < LLSIM_FLIGHT_MAX_ARGS; p = strchr(p + 1, '%')) {
+			conv = p + 1 + strspn(p + 1, "0123456789-+ #.l");
+			if (*conv == '%') {
+				p = conv;
+				continue;
+			}
+			if (*conv == 's')
+				rec->args[rec->nr_args++] = (long) va_arg(ap, char *);
+			else if (llsim_flight_longs(p, conv) == 1)
+				rec->args[rec->nr_args++] = va_arg(ap, long);
+			else if (llsim_flight_longs(p, conv) > 1)
+				rec->args[rec->nr_args++] = va_arg(ap, long long);
+			else
+				rec->args[rec->nr_args++] = va_arg(ap, int);
+			p = conv;
+		}
+		va_end(ap);
+		flight_next = (flight_next + 1) % flight_size;
+		if (flight_count < flight_size)
+			flight_count++;
+	}
+
+	if (llsim_log_levels[category] >= level) {
+		va_start(ap, fmt);
+		vprintf(fmt, ap);
+		va_end(ap);
+	}
+	if (llsim_threads > 1)
+		pthread_mutex_unlock(&log_mutex);
+}
+
+/*
+ * renders a recorded message, one conversion at a time
+ */
+static void llsim_flight_print(FILE *fp, llsim_flight_record_t *rec)
+{
+	const char *p, *conv;
+	char spec[16];
+	int arg, len;
+
+	arg = 0;
+	p = rec->fmt;
+	while (*p) {
+		if (*p != '%') {
+			fputc(*p++, fp);
+			continue;
+		}
+		conv = p + 1 + strspn(p + 1, "0123456789-+ #.l");
+		if (*conv == '%') {
+			fputc('%', fp);
+			p = conv + 1;
+			continue;
+		}
+		len = conv - p + 1;
+		if (len >= (int) sizeof(spec) || arg >= rec->nr_args)
+			break;
+		memcpy(spec, p, len);
+		spec[len] = 0;
+		if (*conv == 's')
+			fprintf(fp, spec, (char *) (long) rec->args[arg++]);
+		else if (llsim_flight_longs(p, conv) == 1)
+			fprintf(fp, spec, (long) rec->args[arg++]);
+		else if (llsim_flight_longs(p, conv) > 1)
+			fprintf(fp, spec, rec->args[arg++]);
+		else
+			fprintf(fp, spec, (int) rec->args[arg++]);
+		p = conv + 1;
+	}
+}
+
+/*
+ * prints the recorded messages of the last flight_cycles clocks
+ */
+void llsim_flight_dump(FILE *fp)
+{
+	llsim_flight_record_t *rec;
+	int i, clock;
+
+	if (!flight_records)
+		return;
+	clock = llsim ? llsim->clock : 0;
+	fprintf(fp, "llsim: flight recorder, last %d clocks:\n", flight_cycles);
+	for (i = 0; i < flight_count; i++) {
+		rec = &flight_records[(flight_next - flight_count + i + flight_size) % flight_size];
+		if (rec->clock <= clock - flight_cycles)
+			continue;
+		fprintf(fp, "[%d %s] ", rec->clock, llsim_log_category_names[rec->category] + 4);
+		llsim_flight_print(fp, rec);
+	}
+	fflush(fp);
+}
+
+static void llsim_flight_signal(int sig)
+{
+	flight_dump_requested = 1;
+}
+
+static void llsim_init_logging(void)
+{
+	int i, level;
+
+	level = llsim_get_param("log_level", LLSIM_LOG_DEBUG);
+	for (i = 0; i < LLSIM_NR_LOG_CATEGORIES; i++)
+		llsim_log_levels[i] = llsim_get_param(llsim_log_category_names[i], level);
+
+	flight_size = llsim_get_param("flight_records", 4096);
+	flight_cycles = llsim_get_param("flight_cycles", 16);
+	if (flight_size > 0) {
+		flight_records = (llsim_flight_record_t *) malloc(flight_size * sizeof(llsim_flight_record_t));
+		if (flight_records == NULL)
+			flight_size = 0;
+		signal(SIGUSR1, llsim_flight_signal);
+	}
+}
+
 /*
  * unit registration functions
  */
@@ -191,6 +446,30 @@ llsim_memory_t *llsim_allocate_memory(llsim_unit_t *unit, char *name, int bits,
 	mem->data = (int *) llsim_malloc((1+height) * mem->entry_size * sizeof(int));
 	mem->datain = (int *) llsim_malloc(mem->entry_size);
 	mem->dataout = (int *) llsim_malloc(mem->entry_size);
+	mem->latency = 1;
+	mem->next = unit->mems;
+	unit->mems = mem;
+	return mem;
+}
+
+/*
+ * another port on a memory of another unit. The port has its own request, data and
+ * latency state and shares the contents; the units decide which port is used in a clock
+ */
+llsim_memory_t *llsim_allocate_memory_port(llsim_unit_t *unit, llsim_memory_t *memory)
+{
+	llsim_memory_t *mem;
+
+	mem = (llsim_memory_t *) llsim_malloc(sizeof(llsim_memory_t));
+	mem->entry_size = memory->entry_size;
+	mem->name = memory->name;
+	mem->bits = memory->bits;
+	mem->height = memory->height;
+	mem->dp = memory->dp;
+	mem->data = memory->data;
+	mem->datain = (int *) llsim_malloc(mem->entry_size);
+	mem->dataout = (int *) llsim_malloc(mem->entry_size);
+	mem->latency = memory->latency;
 	mem->next = unit->mems;
 	unit->mems = mem;
 	return mem;
@@ -214,6 +493,7 @@ int llsim_mem_extract(llsim_memory_t *memory, int addr, int msb, int lsb)
 
 void llsim_mem_write(llsim_memory_t *memory, int addr)
 {
+	llsim_assert(!memory->pending, "ERROR: write to memory %s while a read is pending", memory->name);
 	llsim_assert(!memory->write, "ERROR: multiple memory writes to memory %s", memory->name);
 	memory->write = 1;
 	memory->write_addr = addr;
@@ -221,6 +501,7 @@ void llsim_mem_write(llsim_memory_t *memory, int addr)
 
 void llsim_mem_read(llsim_memory_t *memory, int addr)
 {
+	llsim_assert(!memory->pending, "ERROR: read from memory %s while a read is pending", memory->name);
 	llsim_assert(!memory->read, "ERROR: multiple memory reads to memory %s", memory->name);
 	memory->read = 1;
 	memory->read_addr = addr;
@@ -244,44 +525,106 @@ int llsim_mem_extract_dataout(llsim_memory_t *memory, int msb, int lsb)
 	return sbs(*p,msb,lsb);
 }
 
-void llsim_run_clock(void)
+/*
+ * returns 0 while a multi-cycle read is still in flight
+ */
+int llsim_mem_dataout_ready(llsim_memory_t *memory)
+{
+	return !memory->pending;
+}
+
+static void llsim_run_units(int thread)
 {
 	llsim_unit_t *unit;
-	llsim_unit_registers_t *ur;
+	int i;
+
+	for (i = thread; i < nr_units; i += llsim_threads) {
+		unit = unit_table[i];
+		if (unit->idle_until <= llsim->clock)
+			unit->run(unit);
+	}
+}
+
+static void *llsim_worker(void *arg)
+{
+	int thread = (int) (long) arg;
+
+	for (;;) {
+		pthread_barrier_wait(&clock_start);
+		if (workers_exit)
+			return NULL;
+		llsim_run_units(thread);
+		pthread_barrier_wait(&clock_done);
+	}
+}
+
+/*
+ * serves the memory requests the unit made in this clock
+ */
+static void llsim_run_memories(llsim_unit_t *unit)
+{
 	llsim_memory_t *mem;
 	int read_done, write_done;
-	
-	/*
-	 * run units
-	 */
-	unit = llsim->units;
-	while (unit) {
-		unit->run(unit);
-
-		// memories
-		mem = unit->mems;
-		while (mem) {
-			read_done = mem->read;
-			write_done = mem->write;
-			if (mem->read) {
-				llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
-				*mem->dataout = mem->data[mem->read_addr];
-				llsim_printf("llsim: clock %d: READ MEM %s addr %d --> %08x\n", llsim->clock, mem->name, mem->read_addr, *mem->dataout);
-				mem->read = 0;
+
+	mem = unit->mems;
+	while (mem) {
+		read_done = mem->read;
+		write_done = mem->write;
+		if (mem->read && mem->latency > 1) {
+			llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
+			mem->pending = mem->latency - 1;
+			mem->pending_addr = mem->read_addr;
+			mem->read = 0;
+		} else if (mem->read) {
+			llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
+			*mem->dataout = mem->data[mem->read_addr];
+			llsim_log(LLSIM_LOG_MEM, LLSIM_LOG_DEBUG, "llsim: clock %d: READ MEM %s addr %d --> %08x\n", llsim->clock, mem->name, mem->read_addr, *mem->dataout);
+			mem->read = 0;
+		} else if (mem->pending) {
+			// multi-cycle read, dataout becomes valid once the latency elapsed
+			if (--mem->pending == 0) {
+				*mem->dataout = mem->data[mem->pending_addr];
+				llsim_log(LLSIM_LOG_MEM, LLSIM_LOG_DEBUG, "llsim: clock %d: READ MEM %s addr %d --> %08x\n", llsim->clock, mem->name, mem->pending_addr, *mem->dataout);
+				read_done = 1;
 			}
-			if (mem->write) {
-				llsim_assert(mem->write_addr < mem->height, "mem %s write address %d out of range\n", mem->name, mem->write_addr);
-				mem->data[mem->write_addr] = *mem->datain;
-				llsim_printf("llsim: clock %d: WRITE %08x --> MEM %s addr %d\n", llsim->clock, *mem->datain, mem->name, mem->write_addr);
-				mem->write = 0;
+		}
+		if (mem->write) {
+			llsim_assert(mem->write_addr < mem->height, "mem %s write address %d out of range\n", mem->name, mem->write_addr);
+			if (watchdog_ring)
+				mem_state_hash ^= llsim_watchdog_word(mem, mem->write_addr, mem->data[mem->write_addr]) ^
+					llsim_watchdog_word(mem, mem->write_addr, *mem->datain);
+			mem->data[mem->write_addr] = *mem->datain;
+			if (hash_fp && !llsim->reset) {
+				state_hash = llsim_hash_mix(state_hash, mem->write_addr);
+				state_hash = llsim_hash_mix(state_hash, *mem->datain);
 			}
-			llsim_assert(!(read_done && write_done), "ERROR: simultaneous access to memory %s", mem->name);
-			if (!read_done && !write_done)
-				*mem->dataout = 0xBAADBAAD;
-			mem = mem->next;
+			llsim_log(LLSIM_LOG_MEM, LLSIM_LOG_DEBUG, "llsim: clock %d: WRITE %08x --> MEM %s addr %d\n", llsim->clock, *mem->datain, mem->name, mem->write_addr);
+			mem->write = 0;
 		}
-		unit = unit->next;
+		llsim_assert(!(read_done && write_done), "ERROR: simultaneous access to memory %s", mem->name);
+		if (!read_done && !write_done && !mem->pending)
+			*mem->dataout = 0xBAADBAAD;
+		mem = mem->next;
 	}
+}
+
+void llsim_run_clock(void)
+{
+	llsim_unit_t *unit;
+	llsim_unit_registers_t *ur;
+
+	/*
+	 * run units, then serve their memories in unit order
+	 */
+	if (llsim_threads > 1) {
+		pthread_barrier_wait(&clock_start);
+		llsim_run_units(0);
+		pthread_barrier_wait(&clock_done);
+	} else {
+		llsim_run_units(0);
+	}
+	for (unit = llsim->units; unit; unit = unit->next)
+		llsim_run_memories(unit);
 
 	/*
 	 * copy registers
@@ -295,6 +638,432 @@ void llsim_run_clock(void)
 		}
 		unit = unit->next;
 	}
+
+	if (!llsim->reset) {
+		llsim_trace_registers();
+		llsim_vcd_clock();
+		llsim_hash_clock();
+		llsim_snapshot_clock();
+		llsim_watchdog_clock();
+	}
+}
+
+/*
+ * value of a register, masked to its width
+ */
+int llsim_register_value(llsim_register_t *reg)
+{
+	return *(int *) reg->oldp & bitmask0(reg->bits);
+}
+
+static FILE *llsim_open_trace(char *name, char *mode)
+{
+	FILE *fp;
+
+	fp = fopen(name, mode);
+	llsim_assert(fp != NULL, "couldn't open file %s\n", name);
+	return fp;
+}
+
+/*
+ * binary trace format: "LLSIMTR1", u32 number of registers, per register u8 bits,
+ * u8 name length and "unit.reg". Then per clock with changes u32 clock, u16 number
+ * of changes and per change u16 register index and the value in (bits + 7) / 8 bytes,
+ * all little endian
+ */
+static void llsim_init_tracing(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	unsigned char len;
+	char name[256];
+
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (reg = unit->registers; reg; reg = reg->next)
+			reg->index = nr_traced_registers++;
+
+	if (llsim_get_param("reg_diff", 0))
+		reg_diff_fp = llsim_open_trace("regs_diff.txt", "w");
+	if (!llsim_get_param("reg_trace", 0))
+		return;
+	reg_trace_fp = llsim_open_trace("regs.trace", "wb");
+	reg_trace_buf = (unsigned char *) llsim_malloc(6 + nr_traced_registers * 6);
+	fwrite("LLSIMTR1", 8, 1, reg_trace_fp);
+	fwrite(&nr_traced_registers, 4, 1, reg_trace_fp);
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (reg = unit->registers; reg; reg = reg->next) {
+			snprintf(name, sizeof(name), "%s.%s", reg->unit_name, reg->reg_name);
+			len = strlen(name);
+			fputc(reg->bits, reg_trace_fp);
+			fputc(len, reg_trace_fp);
+			fwrite(name, len, 1, reg_trace_fp);
+		}
+	}
+}
+
+/*
+ * records the registers that changed in this clock, the first clock records all of them
+ */
+static void llsim_trace_registers(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	unsigned short nr_changes, index;
+	unsigned char *buf = reg_trace_buf;
+	int pos, val, i, bytes;
+
+	if (!reg_trace_fp && !reg_diff_fp)
+		return;
+	pos = 6;
+	nr_changes = 0;
+	index = 0;
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (reg = unit->registers; reg; reg = reg->next, index++) {
+			val = llsim_register_value(reg);
+			if (reg_trace_started && val == reg->last_value)
+				continue;
+			if (reg_diff_fp && reg_trace_started)
+				fprintf(reg_diff_fp, "clock %d: %s.%s %x -> %x\n", llsim->clock, reg->unit_name, reg->reg_name, reg->last_value, val);
+			reg->last_value = val;
+			nr_changes++;
+			if (!buf)
+				continue;
+			buf[pos++] = index & 0xff;
+			buf[pos++] = index >> 8;
+			bytes = (reg->bits + 7) / 8;
+			for (i = 0; i < bytes; i++)
+				buf[pos++] = (val >> (8 * i)) & 0xff;
+		}
+	}
+	reg_trace_started = 1;
+	if (!reg_trace_fp || nr_changes == 0)
+		return;
+	memcpy(buf, &llsim->clock, 4);
+	memcpy(buf + 4, &nr_changes, 2);
+	fwrite(buf, pos, 1, reg_trace_fp);
+}
+
+/*
+ * VCD identifier code of a register, base 94 over the printable characters
+ */
+static char *llsim_vcd_id(int index, char *buf)
+{
+	int i = 0;
+
+	do {
+		buf[i++] = '!' + index % 94;
+		index /= 94;
+	} while (index);
+	buf[i] = '\0';
+	return buf;
+}
+
+static void llsim_vcd_value(llsim_register_t *reg, unsigned int val)
+{
+	char id[8];
+	int i;
+
+	llsim_vcd_id(reg->index, id);
+	if (reg->bits == 1) {
+		fprintf(vcd_fp, "%d%s\n", val & 1, id);
+		return;
+	}
+	fputc('b', vcd_fp);
+	for (i = reg->bits - 1; i > 0 && !(val & (1u << i)); i--)
+		;
+	for (; i >= 0; i--)
+		fputc(val & (1u << i) ? '1' : '0', vcd_fp);
+	fprintf(vcd_fp, " %s\n", id);
+}
+
+static void llsim_init_vcd(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	char *signals, *name, cmd[300], id[8];
+	int nr_selected = 0;
+
+	if (!llsim_get_param("vcd", 0))
+		return;
+	signals = llsim_get_param_str("vcd_signals", "*");
+	vcd_start = llsim_get_param("vcd_start", 0);
+	vcd_end = llsim_get_param("vcd_end", -1);
+	vcd_selected = (char *) llsim_malloc(nr_traced_registers + 1);
+	vcd_values = (int *) llsim_malloc((nr_traced_registers + 1) * sizeof(int));
+	if (llsim_get_param("vcd_gzip", 0)) {
+		name = llsim_get_param_str("vcd_file", "waves.vcd.gz");
+		snprintf(cmd, sizeof(cmd), "gzip -c > '%s'", name);
+		vcd_fp = popen(cmd, "w");
+		vcd_is_pipe = 1;
+		llsim_assert(vcd_fp != NULL, "couldn't open file %s\n", name);
+	} else {
+		vcd_fp = llsim_open_trace(llsim_get_param_str("vcd_file", "waves.vcd"), "w");
+	}
+
+	fprintf(vcd_fp, "$version llsim $end\n");
+	fprintf(vcd_fp, "$comment one time unit per clock $end\n");
+	fprintf(vcd_fp, "$timescale 1ns $end\n");
+	for (unit = llsim->units; unit; unit = unit->next) {
+		if (unit->registers == NULL)
+			continue;
+		fprintf(vcd_fp, "$scope module %s $end\n", unit->registers->unit_name);
+		for (reg = unit->registers; reg; reg = reg->next) {
+			if (!llsim_name_matches(signals, reg->unit_name, reg->reg_name))
+				continue;
+			vcd_selected[reg->index] = 1;
+			nr_selected++;
+			fprintf(vcd_fp, "$var reg %d %s %s $end\n", reg->bits, llsim_vcd_id(reg->index, id), reg->reg_name);
+		}
+		fprintf(vcd_fp, "$upscope $end\n");
+	}
+	fprintf(vcd_fp, "$enddefinitions $end\n");
+	llsim_assert(nr_selected > 0, "vcd_signals %s matches no register\n", signals);
+}
+
+/*
+ * dumps the selected registers that changed in this clock, all of them in the first
+ * clock of the window
+ */
+static void llsim_vcd_clock(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	int val, stamped = 0;
+
+	if (!vcd_fp || llsim->clock < vcd_start || (vcd_end >= 0 && llsim->clock > vcd_end))
+		return;
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (reg = unit->registers; reg; reg = reg->next) {
+			if (!vcd_selected[reg->index])
+				continue;
+			val = llsim_register_value(reg);
+			if (vcd_started && val == vcd_values[reg->index])
+				continue;
+			if (!stamped) {
+				fprintf(vcd_fp, "#%d\n", llsim->clock);
+				if (!vcd_started)
+					fprintf(vcd_fp, "$dumpvars\n");
+				stamped = 1;
+			}
+			vcd_values[reg->index] = val;
+			llsim_vcd_value(reg, val);
+		}
+	}
+	if (!vcd_started && stamped)
+		fprintf(vcd_fp, "$end\n");
+	vcd_started = 1;
+}
+
+static void llsim_close_vcd(void)
+{
+	if (!vcd_fp)
+		return;
+	// closing time stamp, so viewers show the last values for a full clock
+	fprintf(vcd_fp, "#%d\n", vcd_end >= 0 && vcd_end < llsim->clock ? vcd_end + 1 : llsim->clock);
+	if (vcd_is_pipe)
+		pclose(vcd_fp);
+	else
+		fclose(vcd_fp);
+}
+
+/*
+ * hash file: "LLSIMHS1", u32 hash_interval, then per checkpoint u32 clock and the u64
+ * rolling hash after that clock. The last clock of the run is always checkpointed
+ */
+static void llsim_init_hash(void)
+{
+	if (!llsim_get_param("state_hash", 0))
+		return;
+	hash_interval = llsim_get_param("hash_interval", 1000);
+	llsim_assert(hash_interval > 0, "hash_interval must be positive\n");
+	hash_fp = llsim_open_trace(llsim_get_param_str("hash_file", "state_hash.bin"), "wb");
+	fwrite("LLSIMHS1", 8, 1, hash_fp);
+	fwrite(&hash_interval, 4, 1, hash_fp);
+}
+
+static void llsim_hash_checkpoint(void)
+{
+	fwrite(&llsim->clock, 4, 1, hash_fp);
+	fwrite(&state_hash, 8, 1, hash_fp);
+}
+
+static void llsim_hash_clock(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+
+	if (!hash_fp)
+		return;
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (reg = unit->registers; reg; reg = reg->next)
+			state_hash = llsim_hash_mix(state_hash, llsim_register_value(reg));
+	if (llsim->clock % hash_interval == 0 || stop_sim)
+		llsim_hash_checkpoint();
+}
+
+static void llsim_close_hash(void)
+{
+	if (!hash_fp)
+		return;
+	fclose(hash_fp);
+}
+
+/*
+ * snapshot file: "LLSIMSN1", u32 number of registers, u32 number of memories, u32 words per
+ * page, per register u8 name length and "unit.reg", per memory u8 name length, name and
+ * u32 number of pages. Then per snapshot u32 clock, u32 per register value and u64 per page hash
+ */
+static void llsim_init_snapshot(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	llsim_memory_t *mem;
+	unsigned char len;
+	char name[256];
+	int nr_mems = 0, nr_pages;
+
+	if (!llsim_get_param("snapshot", 0))
+		return;
+	snapshot_interval = llsim_get_param("snapshot_interval", 1000);
+	snapshot_start = llsim_get_param("snapshot_start", 0);
+	snapshot_end = llsim_get_param("snapshot_end", -1);
+	snapshot_page = llsim_get_param("snapshot_page", 1024);
+	llsim_assert(snapshot_interval > 0 && snapshot_page > 0, "snapshot_interval and snapshot_page must be positive\n");
+	snapshot_fp = llsim_open_trace(llsim_get_param_str("snapshot_file", "snapshots.bin"), "wb");
+
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (mem = unit->mems; mem; mem = mem->next)
+			nr_mems++;
+	fwrite("LLSIMSN1", 8, 1, snapshot_fp);
+	fwrite(&nr_traced_registers, 4, 1, snapshot_fp);
+	fwrite(&nr_mems, 4, 1, snapshot_fp);
+	fwrite(&snapshot_page, 4, 1, snapshot_fp);
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (reg = unit->registers; reg; reg = reg->next) {
+			snprintf(name, sizeof(name), "%s.%s", reg->unit_name, reg->reg_name);
+			len = strlen(name);
+			fputc(len, snapshot_fp);
+			fwrite(name, len, 1, snapshot_fp);
+		}
+	}
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (mem = unit->mems; mem; mem = mem->next) {
+			len = strlen(mem->name);
+			fputc(len, snapshot_fp);
+			fwrite(mem->name, len, 1, snapshot_fp);
+			nr_pages = (mem->height + snapshot_page - 1) / snapshot_page;
+			fwrite(&nr_pages, 4, 1, snapshot_fp);
+		}
+	}
+}
+
+static void llsim_snapshot_clock(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	llsim_memory_t *mem;
+	unsigned long long hash;
+	int val, page, addr;
+
+	if (!snapshot_fp || llsim->clock < snapshot_start || (snapshot_end >= 0 && llsim->clock > snapshot_end))
+		return;
+	if ((llsim->clock - snapshot_start) % snapshot_interval != 0 && !stop_sim)
+		return;
+	fwrite(&llsim->clock, 4, 1, snapshot_fp);
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (reg = unit->registers; reg; reg = reg->next) {
+			val = llsim_register_value(reg);
+			fwrite(&val, 4, 1, snapshot_fp);
+		}
+	}
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (mem = unit->mems; mem; mem = mem->next) {
+			for (page = 0; page < mem->height; page += snapshot_page) {
+				hash = 0xcbf29ce484222325ULL;
+				for (addr = page; addr < page + snapshot_page && addr < mem->height; addr++)
+					hash = llsim_hash_mix(hash, mem->data[addr]);
+				fwrite(&hash, 8, 1, snapshot_fp);
+			}
+		}
+	}
+}
+
+static void llsim_init_watchdog(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+
+	max_cycles = llsim_get_param("max_cycles", 0);
+	if (!llsim_get_param("watchdog", 0))
+		return;
+	watchdog_period = llsim_get_param("watchdog_period", 65536);
+	llsim_assert(watchdog_period > 0, "watchdog_period must be positive\n");
+	watchdog_ignore = llsim_get_param_str("watchdog_ignore", "cycle_counter");
+	watchdog_ring = (unsigned long long *) llsim_malloc(watchdog_period * sizeof(unsigned long long));
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (reg = unit->registers; reg; reg = reg->next)
+			reg->is_ignored = llsim_name_matches(watchdog_ignore, reg->unit_name, reg->reg_name);
+}
+
+static void llsim_watchdog_stop(int period, int since)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+
+	printf("llsim: clock %d: watchdog: the machine state repeats every %d clocks since clock %d\n",
+		   llsim->clock, period, since);
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (reg = unit->registers; reg; reg = reg->next)
+			if (!reg->is_ignored)
+				printf("  %s.%s %08x\n", reg->unit_name, reg->reg_name, llsim_register_value(reg));
+	llsim_flight_dump(stdout);
+	exit(2);
+}
+
+/*
+ * Brent's cycle detection finds a repeated state. A loop is reported once the states
+ * of two more periods matched the period before them, as state outside the registers
+ * and memories (e.g. a branch predictor) may still break it
+ */
+static void llsim_watchdog_clock(void)
+{
+	llsim_unit_t *unit;
+	llsim_register_t *reg;
+	llsim_memory_t *mem;
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	int slot;
+
+	llsim_assert(!max_cycles || llsim->clock < max_cycles, "cycle budget of %d clocks exhausted\n", max_cycles);
+	if (!watchdog_ring)
+		return;
+	for (unit = llsim->units; unit; unit = unit->next) {
+		for (reg = unit->registers; reg; reg = reg->next)
+			if (!reg->is_ignored)
+				hash = llsim_hash_mix(hash, llsim_register_value(reg));
+		for (mem = unit->mems; mem; mem = mem->next) {
+			hash = llsim_hash_mix(hash, mem->pending);
+			hash = llsim_hash_mix(hash, mem->pending_addr);
+		}
+	}
+	hash ^= mem_state_hash;
+	slot = llsim->clock % watchdog_period;
+
+	if (watchdog_loop) {
+		if (watchdog_ring[(slot + watchdog_period - watchdog_loop) % watchdog_period] != hash)
+			watchdog_loop = 0; // not a loop after all
+		else if (llsim->clock - watchdog_loop_clock >= 2 * watchdog_loop)
+			llsim_watchdog_stop(watchdog_loop, watchdog_loop_clock - watchdog_loop);
+	} else if (hash == watchdog_saved && llsim->clock > watchdog_saved_clock) {
+		watchdog_loop = llsim->clock - watchdog_saved_clock;
+		watchdog_loop_clock = llsim->clock;
+	}
+	if (!watchdog_loop && llsim->clock - watchdog_saved_clock >= watchdog_power) {
+		watchdog_saved = hash;
+		watchdog_saved_clock = llsim->clock;
+		if (watchdog_power < watchdog_period)
+			watchdog_power *= 2;
+	}
+	watchdog_ring[slot] = hash;
 }
 
 static void llsim_init_units(char *program_name)
@@ -334,11 +1103,208 @@ void llsim_stop(void)
 	stop_sim = 1;
 }
 
-int main(int argc, char **argv)
+/*
+ * true if something in the kernel records every clock (register traces, waveforms, hashes,
+ * snapshots, watchdog, the clock budget)
+ */
+static int llsim_clocks_traced(void)
+{
+	return reg_trace_fp || reg_diff_fp || vcd_fp || hash_fp || snapshot_fp || watchdog_ring || max_cycles;
+}
+
+/*
+ * true if something in the kernel looks at every clock, the traces or the per clock logs
+ */
+static int llsim_clocks_observed(void)
+{
+	return llsim_clocks_traced() ||
+		   llsim_log_levels[LLSIM_LOG_CLOCK] >= LLSIM_LOG_DEBUG || llsim_log_levels[LLSIM_LOG_MEM] >= LLSIM_LOG_DEBUG ||
+		   llsim_log_levels[LLSIM_LOG_UNIT] >= LLSIM_LOG_DEBUG;
+}
+
+/*
+ * true if a unit may skip clocks on its own: it is the only unit and nothing observes them
+ */
+int llsim_can_skip(void)
+{
+	return llsim->units && !llsim->units->next && !llsim_clocks_observed();
+}
+
+/*
+ * moves the clock forward by n clocks, the unit already brought its state there
+ */
+void llsim_skip_clocks(int n)
+{
+	llsim_assert(llsim_can_skip(), "clocks skipped while they are observed\n");
+	llsim->clock += n;
+}
+
+/*
+ * the unit promises that its state does not change before the given clock, unless another
+ * unit wakes it with llsim_idle_until(unit, 0). The kernel does not run it until then and
+ * jumps over the clocks in which every unit is idle
+ */
+void llsim_idle_until(llsim_unit_t *unit, int clock)
+{
+	unit->idle_until = clock;
+}
+
+/*
+ * moves the clock to the first clock in which a unit runs, as long as no memory access is
+ * in flight and, outside reset, nothing traces the clocks. The logs do not hold it back:
+ * idle units and idle memories do not log, and the skipped clocks get a single clock banner
+ */
+static void llsim_skip_idle_clocks(int limit)
+{
+	llsim_unit_t *unit;
+	llsim_memory_t *mem;
+	int next = limit;
+
+	if (stop_sim || (!llsim->reset && llsim_clocks_traced()))
+		return;
+	for (unit = llsim->units; unit; unit = unit->next) {
+		if (unit->idle_until < next)
+			next = unit->idle_until;
+		for (mem = unit->mems; mem; mem = mem->next)
+			if (mem->pending)
+				return;
+	}
+	if (next <= llsim->clock)
+		return;
+	llsim_assert(next != LLSIM_IDLE_FOREVER, "all units are idle forever at clock %d\n", llsim->clock);
+	// what the skipped clocks would leave on the memory outputs
+	for (unit = llsim->units; unit; unit = unit->next)
+		for (mem = unit->mems; mem; mem = mem->next)
+			*mem->dataout = 0xBAADBAAD;
+	if (!llsim->reset)
+		llsim_log(LLSIM_LOG_CLOCK, LLSIM_LOG_DEBUG, ">>>>> clocks %d - %d idle <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n", llsim->clock, next - 1);
+	llsim->clock = next;
+}
+
+/*
+ * run time parameters, given on the command line after the program name as name=value
+ */
+char *llsim_get_param_str(char *name, char *default_value)
+{
+	int i, len;
+
+	len = strlen(name);
+	for (i = 2; i < llsim_argc; i++)
+		if (strncmp(llsim_argv[i], name, len) == 0 && llsim_argv[i][len] == '=')
+			return llsim_argv[i] + len + 1;
+	return default_value;
+}
+
+int llsim_get_param(char *name, int default_value)
+{
+	char *val;
+
+	val = llsim_get_param_str(name, NULL);
+	if (val == NULL)
+		return default_value;
+	return (int) strtol(val, NULL, 0);
+}
+
+/*
+ * true if the name matches one of the comma separated patterns. A pattern with a dot
+ * is matched against "unit.name", a trailing '*' matches any suffix
+ */
+int llsim_name_matches(char *patterns, char *unit_name, char *name)
+{
+	char pattern[256], full_name[256], *match, *p, *end;
+	int len;
+
+	snprintf(full_name, sizeof(full_name), "%s.%s", unit_name, name);
+	for (p = patterns; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ',');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = end - p;
+		if (len == 0 || len >= sizeof(pattern))
+			continue;
+		memcpy(pattern, p, len);
+		pattern[len] = '\0';
+		match = strchr(pattern, '.') ? full_name : name;
+		if (pattern[len - 1] == '*') {
+			if (strncmp(match, pattern, len - 1) == 0)
+				return 1;
+		} else if (strcmp(match, pattern) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * threads=N runs the units of a clock on N threads, at most one per unit
+ */
+static void llsim_init_threads(void)
+{
+	llsim_unit_t *unit;
+	long i;
+
+	for (unit = llsim->units; unit; unit = unit->next)
+		nr_units++;
+	unit_table = llsim_malloc(nr_units * sizeof(llsim_unit_t *));
+	for (i = 0, unit = llsim->units; unit; unit = unit->next)
+		unit_table[i++] = unit;
+
+	llsim_threads = llsim_get_param("threads", 1);
+	llsim_assert(llsim_threads >= 1, "ERROR: threads must be at least 1\n");
+	if (llsim_threads > nr_units)
+		llsim_threads = nr_units;
+	if (llsim_threads == 1)
+		return;
+	pthread_barrier_init(&clock_start, NULL, llsim_threads);
+	pthread_barrier_init(&clock_done, NULL, llsim_threads);
+	workers = llsim_malloc(llsim_threads * sizeof(pthread_t));
+	for (i = 1; i < llsim_threads; i++)
+		llsim_assert(pthread_create(&workers[i], NULL, llsim_worker, (void *) i) == 0, "ERROR: couldn't create thread %ld\n", i);
+}
+
+static void llsim_close_threads(void)
 {
 	int i;
 
+	if (llsim_threads == 1)
+		return;
+	workers_exit = 1;
+	pthread_barrier_wait(&clock_start);
+	for (i = 1; i < llsim_threads; i++)
+		pthread_join(workers[i], NULL);
+	llsim_threads = 1;
+}
+
+static void llsim_finish_units(void)
+{
+	llsim_unit_t *unit;
+
+	unit = llsim->units;
+	while (unit) {
+		if (unit->finish)
+			unit->finish(unit);
+		unit = unit->next;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	llsim_unit_t *unit;
+
+	if (argc < 2) {
+		printf("usage: %s <program> [name=value ...]\n", argv[0]);
+		exit(1);
+	}
+	llsim_argc = argc;
+	llsim_argv = argv;
+	llsim_init_logging();
 	llsim_init(argv[1]);
+	llsim_init_threads();
+	llsim_init_tracing();
+	llsim_init_vcd();
+	llsim_init_hash();
+	llsim_init_snapshot();
+	llsim_init_watchdog();
 
 	llsim_printf("llsim: starting simulation\n");
 	llsim->reset = 1;
@@ -346,20 +1312,43 @@ int main(int argc, char **argv)
 	// init registers
 	llsim_init_reset_values();
 
-	for (i = 0; i < 5; i++) {
+	while (llsim->clock < LLSIM_RESET_CLOCKS) {
 		llsim_run_clock();
 		llsim->clock++;
+		llsim_skip_idle_clocks(LLSIM_RESET_CLOCKS);
 	}
 	llsim->reset = 0;
+	for (unit = llsim->units; unit; unit = unit->next)
+		llsim_idle_until(unit, 0);
 	while (!stop_sim) {
-		printf(">>>>> clock %d <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n", llsim->clock);
+		llsim_log(LLSIM_LOG_CLOCK, LLSIM_LOG_DEBUG, ">>>>> clock %d <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n", llsim->clock);
 		llsim_run_clock();
 		llsim->clock++;
+		llsim_skip_idle_clocks(LLSIM_IDLE_FOREVER);
+		if (flight_dump_requested) { // SIGUSR1
+			FILE *fp = fopen("flight_recorder.txt", "w");
+
+			if (fp) {
+				llsim_flight_dump(fp);
+				fclose(fp);
+			}
+			flight_dump_requested = 0;
+		}
 		/*
 		if ((llsim->clock % 1000000) == 0)
 			printf("clock %d\n", llsim->clock);
 		*/
 	}
+	llsim_close_threads();
+	llsim_finish_units();
+	if (reg_trace_fp)
+		fclose(reg_trace_fp);
+	if (reg_diff_fp)
+		fclose(reg_diff_fp);
+	llsim_close_vcd();
+	llsim_close_hash();
+	if (snapshot_fp)
+		fclose(snapshot_fp);
 	return 0;
 }
 
@@ -1,9 +1,33 @@
 #ifndef _LLSIM_H_
 #define _LLSIM_H_
+#include <stdio.h>
 typedef long long i64;
 
 void sp_init(char *program_name);
 
+/*
+ * logging. Every message belongs to a category and has a level, it is printed if the
+ * level of its category is high enough. Messages are also kept in binary form in the
+ * flight recorder, which is dumped when an assertion fails.
+ */
+#define LLSIM_LOG_SIM	0	// simulator messages
+#define LLSIM_LOG_CLOCK	1	// clock banner
+#define LLSIM_LOG_MEM	2	// memory reads and writes
+#define LLSIM_LOG_UNIT	3	// unit state every cycle
+#define LLSIM_NR_LOG_CATEGORIES 4
+
+#define LLSIM_LOG_OFF	0
+#define LLSIM_LOG_ERROR	1
+#define LLSIM_LOG_INFO	2
+#define LLSIM_LOG_DEBUG	3
+
+extern int llsim_log_levels[LLSIM_NR_LOG_CATEGORIES];
+
+void llsim_log_event(int category, int level, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
+void llsim_flight_dump(FILE *fp);
+
+#define llsim_log(category, level, args...) llsim_log_event(category, level, args)
+
 /*
  * support functions
  */
@@ -12,11 +36,12 @@ void sp_init(char *program_name);
 		if (!(cond)) {						\
 			printf("llsim: clock %d: assertion failed at file %s line %d: ", llsim->clock, __FILE__, __LINE__); \
 			printf(args);					\
+			llsim_flight_dump(stdout);			\
 			exit (1);					\
 		}							\
 	} while (0);							\
 
-#define llsim_printf	printf
+#define llsim_printf(args...)	llsim_log(LLSIM_LOG_SIM, LLSIM_LOG_INFO, args)
 
 #define llsim_error(args...) llsim_assert(0, args)
 
@@ -133,6 +158,10 @@ typedef struct llsim_memory_s {
 	int *datain;
 	int *dataout;
 
+	int latency;		// cycles from read request to valid dataout
+	int pending;		// cycles left until the pending read completes
+	int pending_addr;
+
 	struct llsim_memory_s *next;
 } llsim_memory_t;
 
@@ -143,6 +172,9 @@ typedef struct llsim_register_s {
 	int reset_value;
 	void *oldp;
 	void *newp;
+	int index;		// position in the register trace
+	int last_value;		// last traced value
+	int is_ignored;		// left out of the watchdog state
 	struct llsim_register_s *next;
 } llsim_register_t;
 
@@ -170,6 +202,8 @@ typedef struct llsim_input_s {
 typedef struct llsim_unit_s {
 	char *name;
 	void (*run) (struct llsim_unit_s *unit);
+	void (*finish) (struct llsim_unit_s *unit);	// optional, called once the simulation stopped
+	int idle_until;		// the unit is not run before this clock, see llsim_idle_until()
 	llsim_unit_registers_t *regs;
 	void *private;
 	llsim_memory_t *mems;
@@ -188,7 +222,10 @@ typedef struct llsim_s {
 	int reset;
 } llsim_t;
 
-llsim_t *llsim;
+extern llsim_t *llsim;
+
+#define LLSIM_RESET_CLOCKS	5
+#define LLSIM_IDLE_FOREVER	0x7fffffff	// until reset is released or another unit wakes it
 
 void *llsim_malloc(int len);
 llsim_unit_t *llsim_register_unit(char *name, void (*run) (struct llsim_unit_s *unit));
@@ -201,16 +238,25 @@ void llsim_register_wire(char *unit_name, char *wire_name, int bits, void *wirep
 void llsim_register_output(char *unit_name, char *output_name, int bits, void *oldp, void *newp);
 void llsim_register_input(char *unit_name, char *input_name, int bits, void *oldp, void *newp);
 void llsim_stop(void);
+void llsim_idle_until(llsim_unit_t *unit, int clock);
+int llsim_can_skip(void);
+void llsim_skip_clocks(int n);
+int llsim_register_value(llsim_register_t *reg);
+char *llsim_get_param_str(char *name, char *default_value);
+int llsim_get_param(char *name, int default_value);
+int llsim_name_matches(char *patterns, char *unit_name, char *name);
 
 /*
  * memories
  */
 llsim_memory_t *llsim_allocate_memory(llsim_unit_t *unit, char *name, int bits, int height, int dp);
+llsim_memory_t *llsim_allocate_memory_port(llsim_unit_t *unit, llsim_memory_t *memory);
 void llsim_mem_inject(llsim_memory_t *memory, int addr, int val, int msb, int lsb);
 int llsim_mem_extract(llsim_memory_t *memory, int addr, int msb, int lsb);
 void llsim_mem_set_datain(llsim_memory_t *memory, int val, int msb, int lsb);
 void llsim_mem_write(llsim_memory_t *memory, int addr);
 void llsim_mem_read(llsim_memory_t *memory, int addr);
 int llsim_mem_extract_dataout(llsim_memory_t *memory, int msb, int lsb);
+int llsim_mem_dataout_ready(llsim_memory_t *memory);
 void llsim_run_clock(void);
 #endif
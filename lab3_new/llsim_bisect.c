@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * finds the first clock in which two simulator runs differ. Both command lines are run
+ * with snapshot=1, the first differing snapshot bounds the divergence, then both runs are
+ * repeated with a snapshot every clock inside that window. The registers and memory pages
+ * that differ in the first differing clock are printed
+ */
+typedef struct bisect_run_s {
+	char *cmd;
+	int nr_regs, nr_mems, page;
+	char **reg_names;
+	char **mem_names;
+	int *mem_pages;
+	int nr_pages;		// over all memories
+	int nr_snapshots;
+	int *clocks;
+	int *values;		// nr_snapshots * nr_regs
+	unsigned long long *hashes; // nr_snapshots * nr_pages
+} bisect_run_t;
+
+static void die(char *msg, char *arg)
+{
+	printf("bisect: %s %s\n", msg, arg);
+	exit(1);
+}
+
+static void read_or_die(void *p, int len, FILE *fp, char *name)
+{
+	if (fread(p, 1, len, fp) != (size_t) len)
+		die("truncated snapshot file", name);
+}
+
+static char *read_name(FILE *fp, char *file)
+{
+	unsigned char len;
+	char *name;
+
+	read_or_die(&len, 1, fp, file);
+	name = calloc(len + 1, 1);
+	read_or_die(name, len, fp, file);
+	return name;
+}
+
+static void run(bisect_run_t *r, char *file, int interval, int start, int end)
+{
+	char cmd[4096];
+
+	remove(file);
+	snprintf(cmd, sizeof(cmd), "%s log_level=0 cycle_trace=0 inst_trace=0 snapshot=1 snapshot_file=%s "
+			 "snapshot_interval=%d snapshot_start=%d snapshot_end=%d > /dev/null", r->cmd, file, interval, start, end);
+	if (system(cmd) != 0)
+		die("failed:", cmd);
+}
+
+static void load(bisect_run_t *r, char *file)
+{
+	FILE *fp;
+	char magic[8];
+	long size, snapshot_size, header;
+	int i;
+
+	fp = fopen(file, "rb");
+	if (fp == NULL)
+		die("couldn't open file", file);
+	read_or_die(magic, 8, fp, file);
+	if (memcmp(magic, "LLSIMSN1", 8) != 0)
+		die("not a snapshot file:", file);
+	read_or_die(&r->nr_regs, 4, fp, file);
+	read_or_die(&r->nr_mems, 4, fp, file);
+	read_or_die(&r->page, 4, fp, file);
+	r->reg_names = calloc(r->nr_regs, sizeof(char *));
+	for (i = 0; i < r->nr_regs; i++)
+		r->reg_names[i] = read_name(fp, file);
+	r->mem_names = calloc(r->nr_mems, sizeof(char *));
+	r->mem_pages = calloc(r->nr_mems, sizeof(int));
+	r->nr_pages = 0;
+	for (i = 0; i < r->nr_mems; i++) {
+		r->mem_names[i] = read_name(fp, file);
+		read_or_die(&r->mem_pages[i], 4, fp, file);
+		r->nr_pages += r->mem_pages[i];
+	}
+
+	header = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp) - header;
+	fseek(fp, header, SEEK_SET);
+	snapshot_size = 4 + 4 * r->nr_regs + 8 * r->nr_pages;
+	r->nr_snapshots = size / snapshot_size;
+	r->clocks = malloc((r->nr_snapshots + 1) * sizeof(int));
+	r->values = malloc(((long) r->nr_snapshots * r->nr_regs + 1) * sizeof(int));
+	r->hashes = malloc(((long) r->nr_snapshots * r->nr_pages + 1) * sizeof(unsigned long long));
+	for (i = 0; i < r->nr_snapshots; i++) {
+		read_or_die(&r->clocks[i], 4, fp, file);
+		read_or_die(&r->values[(long) i * r->nr_regs], 4 * r->nr_regs, fp, file);
+		read_or_die(&r->hashes[(long) i * r->nr_pages], 8 * r->nr_pages, fp, file);
+	}
+	fclose(fp);
+}
+
+static void release(bisect_run_t *r)
+{
+	int i;
+
+	for (i = 0; i < r->nr_regs; i++)
+		free(r->reg_names[i]);
+	for (i = 0; i < r->nr_mems; i++)
+		free(r->mem_names[i]);
+	free(r->reg_names);
+	free(r->mem_names);
+	free(r->mem_pages);
+	free(r->clocks);
+	free(r->values);
+	free(r->hashes);
+}
+
+static int is_same(bisect_run_t *a, bisect_run_t *b, int i)
+{
+	return a->clocks[i] == b->clocks[i] &&
+		   memcmp(&a->values[(long) i * a->nr_regs], &b->values[(long) i * b->nr_regs], 4 * a->nr_regs) == 0 &&
+		   memcmp(&a->hashes[(long) i * a->nr_pages], &b->hashes[(long) i * b->nr_pages], 8 * a->nr_pages) == 0;
+}
+
+/*
+ * first differing snapshot, -1 if the runs match
+ */
+static int first_difference(bisect_run_t *a, bisect_run_t *b)
+{
+	int n, i;
+
+	if (a->nr_regs != b->nr_regs || a->nr_pages != b->nr_pages || a->page != b->page)
+		die("the runs have different registers or memories", "");
+	n = a->nr_snapshots < b->nr_snapshots ? a->nr_snapshots : b->nr_snapshots;
+	for (i = 0; i < n; i++)
+		if (!is_same(a, b, i))
+			return i;
+	return a->nr_snapshots == b->nr_snapshots ? -1 : n;
+}
+
+static void print_difference(bisect_run_t *a, bisect_run_t *b, int i)
+{
+	int j, m, page;
+	long va, vb;
+
+	printf("runs diverge at clock %d\n", a->clocks[i]);
+	for (j = 0; j < a->nr_regs; j++) {
+		va = a->values[(long) i * a->nr_regs + j];
+		vb = b->values[(long) i * b->nr_regs + j];
+		if (va != vb)
+			printf("  %-24s A %08lx B %08lx\n", a->reg_names[j], va & 0xffffffffL, vb & 0xffffffffL);
+	}
+	for (m = 0, j = 0; m < a->nr_mems; m++) {
+		for (page = 0; page < a->mem_pages[m]; page++, j++)
+			if (a->hashes[(long) i * a->nr_pages + j] != b->hashes[(long) i * b->nr_pages + j])
+				printf("  %-24s words %d-%d differ\n", a->mem_names[m], page * a->page, (page + 1) * a->page - 1);
+	}
+}
+
+/*
+ * the state of the runs differs in snapshot i, or one of them stopped there
+ */
+static void report(bisect_run_t *a, bisect_run_t *b, int i)
+{
+	bisect_run_t *stopped;
+
+	if (i < a->nr_snapshots && i < b->nr_snapshots && a->clocks[i] == b->clocks[i]) {
+		if (!is_same(a, b, i)) {
+			print_difference(a, b, i);
+			return;
+		}
+		i++; // same state, but one run stops here
+	}
+	if (i >= a->nr_snapshots)
+		stopped = a;
+	else if (i >= b->nr_snapshots)
+		stopped = b;
+	else
+		stopped = a->clocks[i] < b->clocks[i] ? a : b;
+	printf("run %s stops at clock %d, the other run goes on\n", stopped == a ? "A" : "B",
+		   stopped->clocks[i < stopped->nr_snapshots ? i : i - 1]);
+}
+
+/*
+ * first clock reached by a snapshot of both runs from snapshot i on
+ */
+static int window_end(bisect_run_t *a, bisect_run_t *b, int i)
+{
+	int ca = i < a->nr_snapshots ? a->clocks[i] : a->clocks[i - 1];
+	int cb = i < b->nr_snapshots ? b->clocks[i] : b->clocks[i - 1];
+
+	return ca < cb ? ca : cb;
+}
+
+int main(int argc, char **argv)
+{
+	bisect_run_t a, b;
+	int interval = 1000, i, start, end;
+	int arg = 1;
+
+	if (argc > 2 && strcmp(argv[1], "-i") == 0) {
+		interval = atoi(argv[2]);
+		arg = 3;
+	}
+	if (argc - arg != 2 || interval <= 0) {
+		printf("usage: %s [-i interval] \"<llsim A> <program> [name=value ...]\" \"<llsim B> <program> [name=value ...]\"\n", argv[0]);
+		exit(1);
+	}
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.cmd = argv[arg];
+	b.cmd = argv[arg + 1];
+
+	// coarse pass, a snapshot every interval clocks
+	run(&a, "bisect_a.bin", interval, 0, -1);
+	run(&b, "bisect_b.bin", interval, 0, -1);
+	load(&a, "bisect_a.bin");
+	load(&b, "bisect_b.bin");
+	i = first_difference(&a, &b);
+	if (i < 0) {
+		printf("runs match, %d clocks\n", a.nr_snapshots ? a.clocks[a.nr_snapshots - 1] : 0);
+		return 0;
+	}
+	if (interval == 1 || i >= a.nr_snapshots || i >= b.nr_snapshots) {
+		report(&a, &b, i);
+		return 2;
+	}
+	start = i ? a.clocks[i - 1] + 1 : 0;
+	end = window_end(&a, &b, i);
+	release(&a);
+	release(&b);
+
+	// fine pass, a snapshot every clock of the window
+	run(&a, "bisect_a.bin", 1, start, end);
+	run(&b, "bisect_b.bin", 1, start, end);
+	load(&a, "bisect_a.bin");
+	load(&b, "bisect_b.bin");
+	i = first_difference(&a, &b);
+	report(&a, &b, i < 0 ? a.nr_snapshots - 1 : i);
+	return 2;
+}
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "llsim.h"
+#include "llsim_cache.h"
+
+static int is_power_of_2(int val)
+{
+	return val > 0 && (val & (val - 1)) == 0;
+}
+
+llsim_cache_t *llsim_cache_create(char *name, int size, int assoc, int line_size, int miss_latency, char *policy,
+				  int write_back, int write_allocate)
+{
+	llsim_cache_t *cache;
+	int i;
+
+	llsim_assert(is_power_of_2(size) && is_power_of_2(assoc) && is_power_of_2(line_size),
+		     "ERROR: cache %s size %d, assoc %d and line size %d must be powers of 2\n", name, size, assoc, line_size);
+	llsim_assert(assoc * line_size <= size, "ERROR: cache %s is smaller than one set\n", name);
+	llsim_assert(miss_latency >= 0, "ERROR: cache %s miss latency %d\n", name, miss_latency);
+
+	cache = (llsim_cache_t *) llsim_malloc(sizeof(llsim_cache_t));
+	cache->name = (char *) llsim_malloc(strlen(name)+1);
+	strcpy(cache->name, name);
+	cache->size = size;
+	cache->assoc = assoc;
+	cache->line_size = line_size;
+	cache->miss_latency = miss_latency;
+	cache->write_back = write_back;
+	cache->write_allocate = write_allocate;
+	cache->nr_sets = size / (assoc * line_size);
+	if (strcmp(policy, "lru") == 0)
+		cache->policy = LLSIM_CACHE_LRU;
+	else if (strcmp(policy, "fifo") == 0)
+		cache->policy = LLSIM_CACHE_FIFO;
+	else if (strcmp(policy, "random") == 0)
+		cache->policy = LLSIM_CACHE_RANDOM;
+	else
+		llsim_error("ERROR: cache %s unknown replacement policy %s\n", name, policy);
+
+	cache->tags = (int *) llsim_malloc(cache->nr_sets * assoc * sizeof(int));
+	cache->stamp = (unsigned int *) llsim_malloc(cache->nr_sets * assoc * sizeof(unsigned int));
+	cache->dirty = (char *) llsim_malloc(cache->nr_sets * assoc);
+	for (i = 0; i < cache->nr_sets * assoc; i++)
+		cache->tags[i] = -1;
+	cache->seed = 1;
+	return cache;
+}
+
+static int llsim_cache_victim(llsim_cache_t *cache, int base)
+{
+	int way, victim;
+
+	for (way = 0; way < cache->assoc; way++)
+		if (cache->tags[base + way] == -1)
+			return way;
+	if (cache->policy == LLSIM_CACHE_RANDOM) {
+		cache->seed = cache->seed * 1103515245 + 12345;	// deterministic between runs
+		return (cache->seed >> 16) % cache->assoc;
+	}
+	victim = 0;
+	for (way = 1; way < cache->assoc; way++)
+		if (cache->stamp[base + way] < cache->stamp[base + victim])
+			victim = way;
+	return victim;
+}
+
+static int llsim_cache_lookup(llsim_cache_t *cache, int line, int base)
+{
+	int way;
+
+	for (way = 0; way < cache->assoc; way++)
+		if (cache->tags[base + way] == line)
+			return way;
+	return -1;
+}
+
+/*
+ * looks up addr and fills the line on a miss, returns the stall cycles of the access.
+ * Write through writes and non allocated write misses are assumed to be absorbed by a write buffer
+ */
+int llsim_cache_access(llsim_cache_t *cache, int addr, int is_write)
+{
+	int line, base, way, stall;
+
+	line = addr / cache->line_size;
+	base = (line % cache->nr_sets) * cache->assoc;
+	cache->time++;
+
+	way = llsim_cache_lookup(cache, line, base);
+	if (way >= 0) {
+		cache->hits++;
+		if (cache->policy == LLSIM_CACHE_LRU)
+			cache->stamp[base + way] = cache->time;
+		if (is_write && cache->write_back)
+			cache->dirty[base + way] = 1;
+		else if (is_write)
+			cache->mem_writes++;
+		return 0;
+	}
+
+	cache->misses++;
+	if (is_write && !cache->write_allocate) {
+		cache->mem_writes++;
+		return 0;
+	}
+
+	stall = cache->miss_latency;
+	way = llsim_cache_victim(cache, base);
+	if (cache->tags[base + way] != -1 && cache->dirty[base + way]) {
+		cache->writebacks++;
+		stall += cache->miss_latency;
+	}
+	cache->tags[base + way] = line;
+	cache->stamp[base + way] = cache->time;
+	cache->dirty[base + way] = is_write && cache->write_back;
+	if (is_write && !cache->write_back)
+		cache->mem_writes++;
+	return stall;
+}
+
+/*
+ * keeps the cache coherent with another master accessing the memory behind it.
+ * A dirty line is written back, and a line written by the other master is invalidated
+ */
+void llsim_cache_snoop(llsim_cache_t *cache, int addr, int is_write)
+{
+	int line, base, way;
+
+	line = addr / cache->line_size;
+	base = (line % cache->nr_sets) * cache->assoc;
+	way = llsim_cache_lookup(cache, line, base);
+	if (way < 0)
+		return;
+	if (cache->dirty[base + way]) {
+		cache->writebacks++;
+		cache->dirty[base + way] = 0;
+	}
+	if (is_write)
+		cache->tags[base + way] = -1;
+}
+
+void llsim_cache_dump_stats(llsim_cache_t *cache, FILE *fp)
+{
+	unsigned int accesses = cache->hits + cache->misses;
+
+	fprintf(fp, "%s_hits %u\n", cache->name, cache->hits);
+	fprintf(fp, "%s_misses %u\n", cache->name, cache->misses);
+	fprintf(fp, "%s_miss_rate %.4f\n", cache->name, accesses ? (double) cache->misses / accesses : 0.0);
+	fprintf(fp, "%s_writebacks %u\n", cache->name, cache->writebacks);
+	fprintf(fp, "%s_mem_writes %u\n", cache->name, cache->mem_writes);
+}
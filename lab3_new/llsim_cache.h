@@ -0,0 +1,42 @@
+#ifndef _LLSIM_CACHE_H_
+#define _LLSIM_CACHE_H_
+
+/*
+ * set associative cache timing model. Only tags are kept, the data stays in the
+ * llsim memory behind the cache. Sizes are in memory words.
+ */
+
+// replacement policies
+#define LLSIM_CACHE_LRU 0
+#define LLSIM_CACHE_FIFO 1
+#define LLSIM_CACHE_RANDOM 2
+
+typedef struct llsim_cache_s {
+	char *name;
+	int size;
+	int assoc;
+	int line_size;
+	int miss_latency;
+	int policy;
+	int write_back;		// otherwise write through
+	int write_allocate;	// otherwise write misses go around the cache
+	int nr_sets;
+
+	int *tags;		// nr_sets * assoc line addresses, -1 if invalid
+	unsigned int *stamp;	// last use (lru) or fill (fifo) time per way
+	char *dirty;
+	unsigned int time;
+	unsigned int seed;
+
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int writebacks;	// dirty lines written back to memory
+	unsigned int mem_writes;	// writes passed through to memory
+} llsim_cache_t;
+
+llsim_cache_t *llsim_cache_create(char *name, int size, int assoc, int line_size, int miss_latency, char *policy,
+				  int write_back, int write_allocate);
+int llsim_cache_access(llsim_cache_t *cache, int addr, int is_write);
+void llsim_cache_snoop(llsim_cache_t *cache, int addr, int is_write);
+void llsim_cache_dump_stats(llsim_cache_t *cache, FILE *fp);
+#endif
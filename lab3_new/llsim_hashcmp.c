@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * compares the state hash checkpoints of two runs written with state_hash=1. The hash
+ * rolls over the whole run, so once two runs diverge every later checkpoint differs
+ * and the first differing checkpoint is found by bisection
+ */
+typedef struct hashcmp_checkpoint_s {
+	int clock;
+	unsigned long long hash;
+} hashcmp_checkpoint_t;
+
+typedef struct hashcmp_run_s {
+	char *name;
+	int interval;
+	int nr_checkpoints;
+	hashcmp_checkpoint_t *checkpoints;
+} hashcmp_run_t;
+
+static void load_run(hashcmp_run_t *run, char *name)
+{
+	FILE *fp;
+	char magic[8];
+	long size;
+
+	run->name = name;
+	fp = fopen(name, "rb");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", name);
+		exit(1);
+	}
+	if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, "LLSIMHS1", 8) != 0 ||
+		fread(&run->interval, 4, 1, fp) != 1) {
+		printf("hashcmp: %s is not a state hash file\n", name);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp) - 12;
+	fseek(fp, 12, SEEK_SET);
+	run->nr_checkpoints = size / 12;
+	run->checkpoints = malloc((run->nr_checkpoints + 1) * sizeof(hashcmp_checkpoint_t));
+	for (int i = 0; i < run->nr_checkpoints; i++) {
+		if (fread(&run->checkpoints[i].clock, 4, 1, fp) != 1 || fread(&run->checkpoints[i].hash, 8, 1, fp) != 1) {
+			printf("hashcmp: truncated file %s\n", name);
+			exit(1);
+		}
+	}
+	fclose(fp);
+}
+
+static int is_same(hashcmp_run_t *a, hashcmp_run_t *b, int i)
+{
+	return a->checkpoints[i].clock == b->checkpoints[i].clock && a->checkpoints[i].hash == b->checkpoints[i].hash;
+}
+
+int main(int argc, char **argv)
+{
+	hashcmp_run_t a, b;
+	int n, lo, hi, mid, from;
+
+	if (argc < 3) {
+		printf("usage: %s <state_hash.bin> <golden state_hash.bin>\n", argv[0]);
+		exit(1);
+	}
+	load_run(&a, argv[1]);
+	load_run(&b, argv[2]);
+	if (a.interval != b.interval) {
+		printf("hashcmp: hash_interval differs, %d in %s and %d in %s\n", a.interval, a.name, b.interval, b.name);
+		exit(1);
+	}
+	n = a.nr_checkpoints < b.nr_checkpoints ? a.nr_checkpoints : b.nr_checkpoints;
+
+	// first differing checkpoint in [0, n]
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (is_same(&a, &b, mid))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == n && a.nr_checkpoints == b.nr_checkpoints) {
+		printf("runs match, %d checkpoints up to clock %d\n", n, n ? a.checkpoints[n - 1].clock : 0);
+		return 0;
+	}
+	if (lo == n) {
+		printf("runs match up to clock %d, %s ends there\n", n ? a.checkpoints[n - 1].clock : 0,
+			   a.nr_checkpoints < b.nr_checkpoints ? a.name : b.name);
+		return 2;
+	}
+	from = lo ? a.checkpoints[lo - 1].clock + 1 : 0;
+	if (from == a.checkpoints[lo].clock)
+		printf("runs diverge at clock %d\n", from);
+	else
+		printf("runs diverge between clock %d and %d, rerun both with hash_interval=1 to find the clock\n",
+			   from, a.checkpoints[lo].clock);
+	return 2;
+}
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "llsim.h"
+#include "llsim_stackdist.h"
+
+// the fully associative configurations track up to this many lines
+#define LLSIM_STACKDIST_MAX_LINES 4096
+
+llsim_stackdist_t *llsim_stackdist_create(char *name, int max_line_size, int max_sets, int max_assoc)
+{
+	llsim_stackdist_t *sd;
+	llsim_stackdist_config_t *cfg;
+	int line_size, nr_sets, i;
+
+	sd = (llsim_stackdist_t *) llsim_malloc(sizeof(llsim_stackdist_t));
+	sd->name = (char *) llsim_malloc(strlen(name)+1);
+	strcpy(sd->name, name);
+
+	for (line_size = 1; line_size <= max_line_size; line_size *= 2)
+		for (nr_sets = 1; nr_sets <= max_sets; nr_sets *= 2)
+			sd->nr_configs++;
+	llsim_assert(sd->nr_configs > 0, "ERROR: stack distance %s has no configurations\n", name);
+	sd->configs = (llsim_stackdist_config_t *) llsim_malloc(sd->nr_configs * sizeof(llsim_stackdist_config_t));
+
+	cfg = sd->configs;
+	for (line_size = 1; line_size <= max_line_size; line_size *= 2) {
+		for (nr_sets = 1; nr_sets <= max_sets; nr_sets *= 2) {
+			cfg->line_size = line_size;
+			cfg->nr_sets = nr_sets;
+			cfg->depth = LLSIM_STACKDIST_MAX_LINES / nr_sets;
+			if (cfg->depth < max_assoc)
+				cfg->depth = max_assoc;
+			cfg->stacks = (int *) llsim_malloc(nr_sets * cfg->depth * sizeof(int));
+			for (i = 0; i < nr_sets * cfg->depth; i++)
+				cfg->stacks[i] = -1;
+			cfg->fill = (int *) llsim_malloc(nr_sets * sizeof(int));
+			cfg->hist = (unsigned int *) llsim_malloc((cfg->depth + 1) * sizeof(unsigned int));
+			cfg++;
+		}
+	}
+	return sd;
+}
+
+static void llsim_stackdist_config_access(llsim_stackdist_config_t *cfg, int addr)
+{
+	int line, set, *stack, pos, i;
+
+	line = addr / cfg->line_size;
+	set = line % cfg->nr_sets;
+	stack = cfg->stacks + set * cfg->depth;
+
+	for (pos = 0; pos < cfg->fill[set]; pos++)
+		if (stack[pos] == line)
+			break;
+	cfg->hist[pos < cfg->fill[set] ? pos : cfg->depth]++;
+
+	// move to front, the least recently used line drops off a full stack
+	if (pos == cfg->fill[set]) {
+		if (cfg->fill[set] < cfg->depth)
+			cfg->fill[set]++;
+		else
+			pos--;
+	}
+	for (i = pos; i > 0; i--)
+		stack[i] = stack[i - 1];
+	stack[0] = line;
+}
+
+void llsim_stackdist_access(llsim_stackdist_t *sd, int addr)
+{
+	int i;
+
+	sd->accesses++;
+	for (i = 0; i < sd->nr_configs; i++)
+		llsim_stackdist_config_access(&sd->configs[i], addr);
+}
+
+/*
+ * writes the fully associative histograms, and the hit rate of every
+ * line size / sets / associativity combination that fits the tracked depth
+ */
+void llsim_stackdist_dump(llsim_stackdist_t *sd, FILE *hist_fp, FILE *sweep_fp)
+{
+	llsim_stackdist_config_t *cfg;
+	unsigned int hits;
+	int i, d, assoc;
+
+	for (i = 0; i < sd->nr_configs; i++) {
+		cfg = &sd->configs[i];
+		if (cfg->nr_sets != 1)
+			continue;
+		fprintf(hist_fp, "%s line %d accesses %u\n", sd->name, cfg->line_size, sd->accesses);
+		for (d = 0; d < cfg->depth; d++)
+			if (cfg->hist[d])
+				fprintf(hist_fp, "%d %u\n", d, cfg->hist[d]);
+		fprintf(hist_fp, "inf %u\n\n", cfg->hist[cfg->depth]);
+	}
+
+	for (i = 0; i < sd->nr_configs; i++) {
+		cfg = &sd->configs[i];
+		hits = 0;
+		d = 0;
+		for (assoc = 1; assoc <= cfg->depth; assoc *= 2) {
+			for (; d < assoc; d++)
+				hits += cfg->hist[d];
+			fprintf(sweep_fp, "%s %d %d %d %d %u %u %.4f\n", sd->name, cfg->line_size * cfg->nr_sets * assoc,
+				cfg->line_size, cfg->nr_sets, assoc, hits, sd->accesses,
+				sd->accesses ? (double) hits / sd->accesses : 0.0);
+		}
+	}
+}
@@ -0,0 +1,29 @@
+#ifndef _LLSIM_STACKDIST_H_
+#define _LLSIM_STACKDIST_H_
+
+/*
+ * single pass LRU stack distance analysis of a memory access stream.
+ * For every line size and number of sets (powers of 2) the per set LRU stack
+ * distance histogram is kept, the hit count of a cache with the same line size,
+ * number of sets and associativity A is the number of accesses with distance < A.
+ */
+typedef struct llsim_stackdist_config_s {
+	int line_size;
+	int nr_sets;
+	int depth;		// tracked ways per set, deeper reuses count as misses
+	int *stacks;		// nr_sets * depth line addresses, most recent first
+	int *fill;		// valid entries per set
+	unsigned int *hist;	// depth + 1 buckets, the last one counts misses
+} llsim_stackdist_config_t;
+
+typedef struct llsim_stackdist_s {
+	char *name;
+	int nr_configs;
+	llsim_stackdist_config_t *configs;
+	unsigned int accesses;
+} llsim_stackdist_t;
+
+llsim_stackdist_t *llsim_stackdist_create(char *name, int max_line_size, int max_sets, int max_assoc);
+void llsim_stackdist_access(llsim_stackdist_t *sd, int addr);
+void llsim_stackdist_dump(llsim_stackdist_t *sd, FILE *hist_fp, FILE *sweep_fp);
+#endif
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * prints a binary register trace written by llsim with reg_trace=1,
+ * one "clock name value" line per register change
+ */
+typedef struct trdump_register_s {
+	int bits;
+	char name[256];
+} trdump_register_t;
+
+static void read_or_die(void *p, int len, FILE *fp)
+{
+	if (fread(p, 1, len, fp) != (size_t) len) {
+		printf("trdump: truncated trace\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *fp;
+	char magic[8];
+	trdump_register_t *regs;
+	unsigned char len, bits;
+	unsigned char bytes[4];
+	unsigned short nr_changes, index;
+	int nr_regs, clock, val, i, j;
+
+	if (argc < 2) {
+		printf("usage: %s <regs.trace>\n", argv[0]);
+		exit(1);
+	}
+	fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", argv[1]);
+		exit(1);
+	}
+	read_or_die(magic, 8, fp);
+	if (memcmp(magic, "LLSIMTR1", 8) != 0) {
+		printf("trdump: %s is not a register trace\n", argv[1]);
+		exit(1);
+	}
+	read_or_die(&nr_regs, 4, fp);
+	regs = calloc(nr_regs, sizeof(trdump_register_t));
+	for (i = 0; i < nr_regs; i++) {
+		read_or_die(&bits, 1, fp);
+		read_or_die(&len, 1, fp);
+		regs[i].bits = bits;
+		read_or_die(regs[i].name, len, fp);
+	}
+
+	while (fread(&clock, 4, 1, fp) == 1) {
+		read_or_die(&nr_changes, 2, fp);
+		for (i = 0; i < nr_changes; i++) {
+			read_or_die(&index, 2, fp);
+			if (index >= nr_regs) {
+				printf("trdump: bad register index %d\n", index);
+				exit(1);
+			}
+			read_or_die(bytes, (regs[index].bits + 7) / 8, fp);
+			val = 0;
+			for (j = 0; j < (regs[index].bits + 7) / 8; j++)
+				val |= bytes[j] << (8 * j);
+			printf("%d %s %08x\n", clock, regs[index].name, val);
+		}
+	}
+	fclose(fp);
+	free(regs);
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * random access to cycle_trace.txt and inst_trace.txt through the index written
+ * by llsim with trace_index=1. Prints the record of a cycle or instruction, or
+ * the next record whose pc matches
+ */
+typedef struct trquery_entry_s {
+	int number;		// cycle or instruction number
+	int pc;
+	long long offset;
+} trquery_entry_t;
+
+static trquery_entry_t *entries;
+static int nr_entries;
+
+static void usage(char *prog)
+{
+	printf("usage: %s <trace.txt> cycle|inst <number> [count]\n", prog);
+	printf("       %s <trace.txt> pc <pc> [from number] [count]\n", prog);
+	exit(1);
+}
+
+static void load_index(char *trace_name)
+{
+	char name[1024], magic[8], *dot;
+	FILE *fp;
+	long size;
+
+	snprintf(name, sizeof(name), "%s", trace_name);
+	dot = strrchr(name, '.');
+	if (dot == NULL)
+		dot = name + strlen(name);
+	snprintf(dot, sizeof(name) - (dot - name), ".idx");
+	fp = fopen(name, "rb");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", name);
+		exit(1);
+	}
+	if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, "LLSIMIX1", 8) != 0) {
+		printf("trquery: %s is not a trace index\n", name);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp) - 8;
+	fseek(fp, 8, SEEK_SET);
+	nr_entries = size / 16;
+	entries = malloc((nr_entries + 1) * sizeof(trquery_entry_t));
+	for (int i = 0; i < nr_entries; i++) {
+		if (fread(&entries[i].number, 4, 1, fp) != 1 || fread(&entries[i].pc, 4, 1, fp) != 1 ||
+			fread(&entries[i].offset, 8, 1, fp) != 1) {
+			printf("trquery: truncated index %s\n", name);
+			exit(1);
+		}
+	}
+	fclose(fp);
+}
+
+/*
+ * first entry with a number of at least n, entries are written in increasing order
+ */
+static int find_number(int n)
+{
+	int lo = 0, hi = nr_entries, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entries[mid].number < n)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * copies records [first, first + count) of the trace to stdout
+ */
+static void print_records(FILE *trace, int first, int count)
+{
+	long long end;
+	char buf[65536];
+	size_t len;
+
+	if (first + count > nr_entries)
+		count = nr_entries - first;
+	if (count <= 0)
+		return;
+	if (first + count < nr_entries) {
+		end = entries[first + count].offset;
+	} else {
+		fseek(trace, 0, SEEK_END);
+		end = ftell(trace);
+	}
+	fseek(trace, entries[first].offset, SEEK_SET);
+	for (long long left = end - entries[first].offset; left > 0; left -= len) {
+		len = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), trace);
+		if (len == 0)
+			break;
+		fwrite(buf, 1, len, stdout);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *trace;
+	int i, arg, value, from = 0, count = 1;
+
+	if (argc < 4)
+		usage(argv[0]);
+	value = strtol(argv[3], NULL, 0);
+	load_index(argv[1]);
+	trace = fopen(argv[1], "rb");
+	if (trace == NULL) {
+		printf("couldn't open file %s\n", argv[1]);
+		exit(1);
+	}
+
+	if (strcmp(argv[2], "cycle") == 0 || strcmp(argv[2], "inst") == 0) {
+		if (argc > 4)
+			count = strtol(argv[4], NULL, 0);
+		i = find_number(value);
+		if (i == nr_entries || entries[i].number != value) {
+			printf("trquery: %s %d is not in the trace\n", argv[2], value);
+			exit(1);
+		}
+	} else if (strcmp(argv[2], "pc") == 0) {
+		arg = 4;
+		if (argc > arg && strcmp(argv[arg], "from") == 0) {
+			if (argc == arg + 1)
+				usage(argv[0]);
+			from = strtol(argv[arg + 1], NULL, 0);
+			arg += 2;
+		}
+		if (argc > arg)
+			count = strtol(argv[arg], NULL, 0);
+		for (i = find_number(from); i < nr_entries && entries[i].pc != value; i++)
+			;
+		if (i == nr_entries) {
+			printf("trquery: pc %d not found from %d\n", value, from);
+			exit(1);
+		}
+	} else {
+		usage(argv[0]);
+	}
+	print_records(trace, i, count);
+	fclose(trace);
+	free(entries);
+	return 0;
+}
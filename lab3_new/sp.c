@@ -11,27 +11,22 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "llsim.h"
+#include "llsim_cache.h"
+#include "llsim_stackdist.h"
 
-#define sp_printf(a...)                               \
-	do                                                \
-	{                                                 \
-		llsim_printf("sp: clock %d: ", llsim->clock); \
-		llsim_printf(a);                              \
-	} while (0)
+#define sp_printf(fmt, a...) llsim_log(LLSIM_LOG_UNIT, LLSIM_LOG_DEBUG, "sp: clock %d: " fmt, llsim->clock, ##a)
 
-int nr_simulated_instructions = 0;
-FILE *inst_trace_fp = NULL, *cycle_trace_fp = NULL;
+// inst_trace.txt output, only while the trace window is open
+#define inst_printf(sp, fmt, a...) do { if ((sp)->inst_trace_on) (sp)->inst_trace_bytes += fprintf((sp)->inst_trace_fp, fmt, ##a); } while (0)
 
 // dma states
 #define DMA_STATE_IDLE 0
 #define DMA_STATE_WAIT 1
 #define DMA_STATE_ACTIVE 2
 
-bool is_dma_done = false;
-bool is_dma_active = false;
-
 typedef struct sp_registers_s
 {
 	// 6 32 bit registers (r[0], r[1] don't exist)
@@ -86,23 +81,165 @@ typedef struct sp_registers_s
 	int exec1_immediate; // 32 bits
 	int exec1_alu0;		 // 32 bits
 	int exec1_alu1;		 // 32 bits
-	int exec1_aluout;
+	int exec1_aluout;	 // 32 bits
 
 	// dma
-	int dma_source;
-	int dma_destination;
-	int dma_length;
-	int dma_state;
-	int dma_remain;
-	bool is_dma_busy;
+	int dma_source;		 // 32 bits
+	int dma_destination; // 32 bits
+	int dma_length;		 // 32 bits
+	int dma_state;		 // 2 bits
+	int dma_remain;		 // 32 bits
+	int is_dma_busy;	 // 1 bit
+
+	// mailbox requests of the last clock, applied by the mailbox unit
+	int mbox_push;		 // 1 bit
+	int mbox_push_core;	 // 6 bits
+	int mbox_push_data;	 // 32 bits
+	int mbox_pop;		 // 1 bit
+
+	// multiply and divide unit
+	int muldiv_cycles;	 // 8 bits, cycles the MUL/DIV in exec0 has been busy
+
+	// simulation only: cause of the bubble in each stage, travels down with the bubble
+	int bubble_cause[6]; // 3 bits each
+
+	// simulation only: instruction sequence number in each stage, for the pipeline viewer
+	int seq[6];
 
 } sp_registers_t;
 
+// performance counters, readable by the CNT opcode with the counter index as operand
+#define CNT_CYCLES 0
+#define CNT_RETIRED 1
+#define CNT_BRANCH_TAKEN 2
+#define CNT_BRANCH_NOT_TAKEN 3
+#define CNT_MISPREDICT 4
+#define CNT_FLUSH 5
+#define CNT_LD_AFTER_ST_STALL 6
+#define CNT_SRAMD_STALL 7
+#define CNT_DMA_BUSY 8
+#define CNT_MEM_PORT_CONFLICT 9
+#define CNT_BUBBLE_FETCH0 10
+#define CNT_BUBBLE_FETCH1 11
+#define CNT_BUBBLE_DEC0 12
+#define CNT_BUBBLE_DEC1 13
+#define CNT_BUBBLE_EXEC0 14
+#define CNT_BUBBLE_EXEC1 15
+#define CNT_ICACHE_STALL 16
+#define CNT_DCACHE_STALL 17
+#define CNT_BUS_WAIT 18
+#define CNT_MBOX_WAIT 19
+#define CNT_MULDIV_BUSY 20
+#define SP_NR_COUNTERS 21
+
+static char counter_name[SP_NR_COUNTERS][24] = {"cycles", "retired", "branch_taken", "branch_not_taken",
+												"mispredict", "flush", "ld_after_st_stall", "sramd_stall",
+												"dma_busy", "mem_port_conflict", "bubble_fetch0", "bubble_fetch1",
+												"bubble_dec0", "bubble_dec1", "bubble_exec0", "bubble_exec1",
+												"icache_stall", "dcache_stall", "bus_wait", "mbox_wait", "muldiv_busy"};
+
+// pipeline stages
+#define STAGE_FETCH0 0
+#define STAGE_FETCH1 1
+#define STAGE_DEC0 2
+#define STAGE_DEC1 3
+#define STAGE_EXEC0 4
+#define STAGE_EXEC1 5
+#define SP_NR_STAGES 6
+
+// bubble causes, reset value is startup
+#define BUBBLE_STARTUP 0
+#define BUBBLE_FLUSH 1
+#define BUBBLE_REDIRECT 2
+#define BUBBLE_LD_AFTER_ST 3
+#define BUBBLE_SRAMD_STALL 4
+#define BUBBLE_DMA_DRAIN 5
+#define BUBBLE_ICACHE_MISS 6
+#define SP_NR_BUBBLE_CAUSES 7
+
+static char stage_name[SP_NR_STAGES][8] = {"fetch0", "fetch1", "dec0", "dec1", "exec0", "exec1"};
+static char bubble_cause_name[SP_NR_BUBBLE_CAUSES][16] = {"startup", "flush", "redirect", "ld_after_st",
+														  "sramd_stall", "dma_drain", "icache_miss"};
+
+// memory access sources
+#define ACCESS_FETCH 0
+#define ACCESS_LD 1
+#define ACCESS_ST 2
+#define ACCESS_DMA_READ 3
+#define ACCESS_DMA_WRITE 4
+#define SP_NR_ACCESS_SOURCES 5
+
+static char access_source_name[SP_NR_ACCESS_SOURCES][12] = {"fetch", "ld", "st", "dma_read", "dma_write"};
+
+// memory heatmap, strides between consecutive accesses of a source are kept up to +-HEATMAP_MAX_STRIDE
+#define HEATMAP_MAX_STRIDE 64
+#define HEATMAP_TOP 10
+
+typedef struct sp_heatmap_s
+{
+	unsigned int *reads;   // sramd, LD and DMA
+	unsigned int *writes;  // sramd, ST and DMA
+	unsigned int *fetches; // srami
+	unsigned int accesses[SP_NR_ACCESS_SOURCES];
+	int last_addr[SP_NR_ACCESS_SOURCES];
+	unsigned int strides[SP_NR_ACCESS_SOURCES][2 * HEATMAP_MAX_STRIDE + 2]; // the last bucket counts larger strides
+	int block_size;
+} sp_heatmap_t;
+
+// functional reference model of the ISA, checked against every retirement in exec1
+typedef struct sp_ref_s
+{
+	int r[8];
+	int pc;
+	int halted;
+	unsigned int *imem; // copy of the program image
+	unsigned int *dmem; // follows ST and the DMA engine writes
+} sp_ref_t;
+
+// fast forward, the state of one cycle
+#define FF_MAX_PERIOD 64
+#define FF_FRAMES (3 * FF_MAX_PERIOD + 1)
+#define FF_NR_STATS (SP_NR_COUNTERS + SP_NR_STAGES * SP_NR_BUBBLE_CAUSES + SP_NR_BUBBLE_CAUSES)
+#define FF_NR_WORDS (sizeof(sp_registers_t) / sizeof(int))
+
+typedef struct sp_ff_frame_s
+{
+	sp_registers_t regs;
+	unsigned int stats[FF_NR_STATS]; // counters, bubbles and lost cycles
+	int inst_cnt;
+	int is_dma_done, is_dma_active;
+	unsigned int mem_accesses; // cycles with a memory operation in the pipeline so far
+	int mem_pending;
+	unsigned int branch_hist_hash;
+} sp_ff_frame_t;
+
+// per pc profile entry, cycles are attributed to the oldest active stage
+typedef struct sp_profile_entry_s
+{
+	unsigned int count;		  // retired instructions
+	unsigned int cycles;	  // cycles at the head of the pipeline
+	unsigned int stalls;	  // head cycles without a retirement
+	unsigned int mispredicts; // flushes caused by this branch
+} sp_profile_entry_t;
+
+#define SP_MAX_CORES 64
+
+// branch prediction defines
+#define branch_hist_SIZE 10
+#define PREDICT_STRONG_NT 0
+#define PREDICT_WEAK_NT 1
+#define PREDICT_WEAK_T 2
+#define PREDICT_STRONG_T 3
+
 /*
  * Master structure
  */
 typedef struct sp_s
 {
+	char *name;	// unit name, "sp" or "sp<id>" with several cores
+	int id;
+	FILE *inst_trace_fp, *cycle_trace_fp;
+
 	// local srams
 #define SP_SRAM_HEIGHT 64 * 1024
 	llsim_memory_t *srami, *sramd;
@@ -114,6 +251,72 @@ typedef struct sp_s
 
 	sp_registers_t *spro, *sprn;
 
+	int inst_cnt;
+	int branch_hist[branch_hist_SIZE];
+	bool is_dma_done, is_dma_active;
+	bool is_bus_granted;	// the shared SRAMD port is ours this clock, see sp_bus_winner()
+	bool is_halted;		// several cores: retired HLT, waits for the other cores
+
+	unsigned int counters[SP_NR_COUNTERS];
+
+	sp_profile_entry_t *profile; // NULL unless profile=1
+
+	// lost slots per stage and cause, and lost retire slots per cause
+	unsigned int bubbles[SP_NR_STAGES][SP_NR_BUBBLE_CAUSES];
+	unsigned int lost_cycles[SP_NR_BUBBLE_CAUSES];
+	char *program_name;
+
+	// pipeline viewer (Kanata format), NULL unless pipeview=1
+	FILE *pipeview_fp;
+	int next_seq;
+	int pv_last_seq;		   // last sequence number introduced to the viewer
+	int pv_retired;
+	int pv_active[SP_NR_STAGES]; // stage occupancy of the previous cycle
+	int pv_seq[SP_NR_STAGES];
+
+	// instruction cache in front of srami, NULL unless icache_size is set
+	llsim_cache_t *icache;
+	int icache_stall; // cycles left for the current line fill
+
+	// data cache in front of sramd, NULL unless dcache_size is set
+	llsim_cache_t *dcache;
+	int dcache_stall; // cycles left for a store miss
+	int dcache_load_stall; // cycles left for a load miss, the SRAMD read follows
+
+	// stack distance analysis of the srami and sramd access streams, NULL unless stack_distance=1
+	llsim_stackdist_t *srami_sd, *sramd_sd;
+
+	sp_heatmap_t *heatmap; // NULL unless heatmap=1
+
+	sp_ref_t *ref; // NULL unless cosim=1
+
+	int max_insts; // instruction budget, 0 for none
+	int mul_latency, div_latency; // cycles of MUL/MULH and DIV/REM in exec0
+
+	// fast forward of steady states, see ff_cycle()
+	int fast_forward;
+	sp_ff_frame_t *ff_frames; // ring of the last FF_FRAMES cycles
+	int ff_nr_frames;
+	unsigned int ff_mem_accesses;
+	char ff_is_linear[FF_NR_WORDS]; // fields that may move in a steady state
+	long long ff_skipped;
+
+	// trace window, see update_trace_window()
+	int cycle_trace, inst_trace;		// trace files enabled
+	int trace_start, trace_end;		// cycle window, trace_end -1 for no end
+	int trace_pc_lo, trace_pc_hi;		// pc range, trace_pc_hi -1 for no limit
+	int trace_after_cpy;			// trigger: first CPY retired
+	int trace_st_addr;			// trigger: first ST to this address, -1 for none
+	int trace_triggered;
+	int cycle_trace_on, inst_trace_on;
+
+	// trace indexes, NULL unless trace_index=1. Bytes written so far give the record offsets
+	FILE *cycle_index_fp, *inst_index_fp;
+	long long cycle_trace_bytes, inst_trace_bytes;
+	int nr_trace_registers;	// the first registers of the unit are the cycle_trace.txt fields
+	llsim_register_t **cycle_trace_regs;	// those selected by trace_fields
+	int nr_cycle_trace_regs;
+
 } sp_t;
 
 static void sp_reset(sp_t *sp)
@@ -136,6 +339,11 @@ static void sp_reset(sp_t *sp)
 #define LHI 7
 #define LD 8
 #define ST 9
+#define SWP 10 // atomic read-modify-write of MEM[src1], the old value goes to dst
+#define CAS 11
+#define FAA 12
+#define SND 13 // pushes src0 to the mailbox of core src1
+#define RCV 14 // pops the mailbox of the core to dst, waits while it is empty
 #define JLT 16
 #define JLE 17
 #define JEQ 18
@@ -144,7 +352,12 @@ static void sp_reset(sp_t *sp)
 #define CPY 21
 #define POL 22
 
+#define CNT 23
 #define HLT 24
+#define MUL 25	// low 32 bits of src0 * src1, mul_latency cycles in exec0
+#define MULH 26	// high 32 bits of the signed product
+#define DIV 27	// signed src0 / src1, div_latency cycles in exec0
+#define REM 28
 
 // decode defines
 #define OPCODE_MASK 0x3E000000
@@ -161,20 +374,59 @@ static void sp_reset(sp_t *sp)
 #define SIGN_EXT_MASK 0x00008000
 #define SIGN_EXT 0xFFFF0000
 
-// branch prediction defines
-#define branch_hist_SIZE 10
-#define PREDICT_STRONG_NT 0
-#define PREDICT_WEAK_NT 1
-#define PREDICT_WEAK_T 2
-#define PREDICT_STRONG_T 3
+/*
+ * several cores share one SRAMD. Each core reaches it through its own port, and a
+ * single port is granted per clock. The winner is a function of the registers of the
+ * previous clock only, so every core computes the same one. NULL with a single core
+ */
+typedef struct sp_bus_s
+{
+	int nr_cores;
+	sp_t **cores;
+	int is_round_robin;	// else fixed priority, core 0 first
+	int *last_old, *last_new;	// last granted core, the register of the sramd_bus unit
+	int nr_running;
+} sp_bus_t;
 
-static char opcode_name[32][4] = {"ADD", "SUB", "LSF", "RSF", "AND", "OR", "XOR", "LHI",
-								  "LD", "ST", "U", "U", "U", "U", "U", "U",
-								  "JLT", "JLE", "JEQ", "JNE", "JIN", "CPY", "POL", "U",
-								  "HLT", "U", "U", "U", "U", "U", "U", "U"};
+static sp_bus_t *sp_bus;
 
-static int inst_cnt = 0;
-static int branch_hist[branch_hist_SIZE];
+/*
+ * one hardware FIFO per core, filled by SND of any core and drained by RCV of its core.
+ * The cores post their requests in their registers and the mailbox unit applies them in
+ * the next clock, in core order. Every decision uses the state of the previous clock, so
+ * the cores may run in any order. NULL with a single core
+ */
+typedef struct sp_mbox_s
+{
+	int depth;
+	int *old, *new;	// per core head, count and depth words, the registers of the mailbox unit
+} sp_mbox_t;
+
+#define MBOX_HEAD(regs, id) ((regs)[(id) * (sp_mbox->depth + 2)])
+#define MBOX_COUNT(regs, id) ((regs)[(id) * (sp_mbox->depth + 2) + 1])
+#define MBOX_DATA(regs, id, i) ((regs)[(id) * (sp_mbox->depth + 2) + 2 + (i) % sp_mbox->depth])
+
+static sp_mbox_t *sp_mbox;
+
+static char opcode_name[32][5] = {"ADD", "SUB", "LSF", "RSF", "AND", "OR", "XOR", "LHI",
+								  "LD", "ST", "SWP", "CAS", "FAA", "SND", "RCV", "U",
+								  "JLT", "JLE", "JEQ", "JNE", "JIN", "CPY", "POL", "CNT",
+								  "HLT", "MUL", "MULH", "DIV", "REM", "U", "U", "U"};
+
+/* This method names an output file of the core. With several cores the core id goes
+   before the extension, "inst_trace.txt" becomes "inst_trace_1.txt" */
+static char *sp_file_name(sp_t *sp, char *name) {
+	char *file_name, *dot;
+
+	if (!sp_bus)
+		return name;
+	dot = strrchr(name, '.');
+	if (dot == NULL)
+		dot = name + strlen(name);
+	file_name = llsim_malloc(strlen(name) + 16);
+	sprintf(file_name, "%.*s_%d%s", (int) (dot - name), name, sp->id, dot);
+	return file_name;
+}
 
 static void dump_sram(sp_t *sp, char *name, llsim_memory_t *sram) {
 	FILE *fp;
@@ -191,21 +443,481 @@ static void dump_sram(sp_t *sp, char *name, llsim_memory_t *sram) {
 	fclose(fp);
 }
 
+/* This method writes the performance counters as "name value" lines */
+static void dump_counters(sp_t *sp, char *name) {
+	FILE *fp;
+	int i;
+
+	fp = fopen(name, "w");
+	if (fp == NULL)
+	{
+		printf("couldn't open file %s\n", name);
+		exit(1);
+	}
+	for (i = 0; i < SP_NR_COUNTERS; i++)
+		fprintf(fp, "%s %u\n", counter_name[i], sp->counters[i]);
+	fprintf(fp, "cpi %.4f\n", sp->counters[CNT_RETIRED] ? (double)sp->counters[CNT_CYCLES] / sp->counters[CNT_RETIRED] : 0.0);
+	if (sp->icache)
+		llsim_cache_dump_stats(sp->icache, fp);
+	if (sp->dcache)
+		llsim_cache_dump_stats(sp->dcache, fp);
+	fclose(fp);
+}
+
+/* This method ends the run of the core after HLT. The simulation stops with the last
+   running core, which writes the shared SRAMD */
+static void halt_core(sp_t *sp, sp_registers_t *sprn) {
+	if (sp_bus) {
+		// an empty pipeline, the halted core asks for no port
+		sprn->fetch0_active = sprn->fetch1_active = sprn->dec0_active = 0;
+		sprn->dec1_active = sprn->exec0_active = sprn->exec1_active = 0;
+		sp->is_halted = true;
+		if (__atomic_sub_fetch(&sp_bus->nr_running, 1, __ATOMIC_SEQ_CST) > 0) // cores may run on several threads
+			return;
+	}
+	llsim_stop();
+	dump_sram(sp, "sramd_out.txt", sp->sramd);
+}
+
+/* This method updates the per cycle counters from the current pipeline state */
+static void count_cycle(sp_t *sp, sp_registers_t *spro) {
+	sp->counters[CNT_CYCLES]++;
+	sp->counters[CNT_BUBBLE_FETCH0] += !spro->fetch0_active;
+	sp->counters[CNT_BUBBLE_FETCH1] += !spro->fetch1_active;
+	sp->counters[CNT_BUBBLE_DEC0] += !spro->dec0_active;
+	sp->counters[CNT_BUBBLE_DEC1] += !spro->dec1_active;
+	sp->counters[CNT_BUBBLE_EXEC0] += !spro->exec0_active;
+	sp->counters[CNT_BUBBLE_EXEC1] += !spro->exec1_active;
+	if (spro->is_dma_busy)
+		sp->counters[CNT_DMA_BUSY]++;
+}
+
+/* This method returns the pc of the oldest active stage, or -1 if the pipeline is empty */
+static int head_pc(sp_registers_t *spro) {
+	if (spro->exec1_active)
+		return spro->exec1_pc;
+	if (spro->exec0_active)
+		return spro->exec0_pc;
+	if (spro->dec1_active)
+		return spro->dec1_pc;
+	if (spro->dec0_active)
+		return spro->dec0_pc;
+	if (spro->fetch1_active)
+		return spro->fetch1_pc;
+	if (spro->fetch0_active)
+		return spro->fetch0_pc;
+	return -1;
+}
+
+/* This method attributes the current cycle to the pc at the head of the pipeline */
+static void profile_cycle(sp_t *sp, sp_registers_t *spro, bool is_stalled) {
+	int pc = head_pc(spro);
+
+	if (pc < 0)
+		return;
+	sp->profile[pc].cycles++;
+	if (is_stalled || !spro->exec1_active)
+		sp->profile[pc].stalls++;
+}
+
+static sp_profile_entry_t *profile_sort_base;
+
+static int profile_cmp(const void *a, const void *b) {
+	unsigned int ca = profile_sort_base[*(const int *)a].cycles;
+	unsigned int cb = profile_sort_base[*(const int *)b].cycles;
+
+	if (ca != cb)
+		return ca < cb ? 1 : -1;
+	return *(const int *)a - *(const int *)b;
+}
+
+/* This method writes the profile as a table sorted by cycles, and as collapsed stacks for flame graphs */
+static void dump_profile(sp_t *sp, char *table_name, char *folded_name) {
+	FILE *fp, *ffp;
+	int *order, nr_pcs, i, pc, opcode;
+
+	order = llsim_malloc(SP_SRAM_HEIGHT * sizeof(int));
+	nr_pcs = 0;
+	for (pc = 0; pc < SP_SRAM_HEIGHT; pc++)
+		if (sp->profile[pc].cycles || sp->profile[pc].count)
+			order[nr_pcs++] = pc;
+	profile_sort_base = sp->profile;
+	qsort(order, nr_pcs, sizeof(int), profile_cmp);
+
+	fp = fopen(table_name, "w");
+	ffp = fopen(folded_name, "w");
+	if (fp == NULL || ffp == NULL)
+	{
+		printf("couldn't open file %s\n", fp == NULL ? table_name : folded_name);
+		exit(1);
+	}
+	fprintf(fp, "%-6s %-4s %10s %10s %6s %10s %10s\n", "pc", "inst", "count", "cycles", "%", "stalls", "mispredict");
+	for (i = 0; i < nr_pcs; i++) {
+		pc = order[i];
+		opcode = sbs(llsim_mem_extract(sp->srami, pc, 31, 0), 29, 25);
+		fprintf(fp, "%04x   %-4s %10u %10u %6.2f %10u %10u\n", pc, opcode_name[opcode], sp->profile[pc].count,
+				sp->profile[pc].cycles, sp->counters[CNT_CYCLES] ? 100.0 * sp->profile[pc].cycles / sp->counters[CNT_CYCLES] : 0.0,
+				sp->profile[pc].stalls, sp->profile[pc].mispredicts);
+		if (sp->profile[pc].cycles)
+			fprintf(ffp, "sp;%s_%04x %u\n", opcode_name[opcode], pc, sp->profile[pc].cycles);
+	}
+	fclose(fp);
+	fclose(ffp);
+	free(order);
+}
+
+/* This method charges the empty slots of the current cycle to their causes.
+   A cycle in which exec1 doesn't retire is a lost cycle */
+static void count_bubbles(sp_t *sp, sp_registers_t *spro, bool is_stalled) {
+	int active[SP_NR_STAGES] = {spro->fetch0_active, spro->fetch1_active, spro->dec0_active,
+								spro->dec1_active, spro->exec0_active, spro->exec1_active};
+	int i;
+
+	for (i = 0; i < SP_NR_STAGES; i++) {
+		if (is_stalled)
+			sp->bubbles[i][BUBBLE_SRAMD_STALL]++;
+		else if (!active[i])
+			sp->bubbles[i][spro->bubble_cause[i]]++;
+	}
+
+	if (is_stalled)
+		sp->lost_cycles[BUBBLE_SRAMD_STALL]++;
+	else if (sp->is_dma_done)
+		sp->lost_cycles[BUBBLE_DMA_DRAIN]++;
+	else if (!spro->exec1_active)
+		sp->lost_cycles[spro->bubble_cause[STAGE_EXEC1]]++;
+}
+
+/* This method sets the cause of every empty stage for the next cycle. Stages squashed
+   this cycle get their squash cause, other bubbles move down from the previous stage */
+static void classify_bubbles(sp_registers_t *spro, sp_registers_t *sprn, int *squash_cause) {
+	int active[SP_NR_STAGES] = {sprn->fetch0_active, sprn->fetch1_active, sprn->dec0_active,
+								sprn->dec1_active, sprn->exec0_active, sprn->exec1_active};
+	int i;
+
+	for (i = 0; i < SP_NR_STAGES; i++) {
+		if (active[i])
+			sprn->bubble_cause[i] = BUBBLE_STARTUP;
+		else if (squash_cause[i] >= 0)
+			sprn->bubble_cause[i] = squash_cause[i];
+		else if (i == STAGE_FETCH0)
+			sprn->bubble_cause[i] = BUBBLE_STARTUP;
+		else
+			sprn->bubble_cause[i] = spro->bubble_cause[i - 1];
+	}
+}
+
+/* This method writes the top-down breakdown of lost cycles and the per stage bubble causes */
+static void dump_bubbles(sp_t *sp, char *name) {
+	FILE *fp;
+	unsigned int cycles = sp->counters[CNT_CYCLES];
+	unsigned int retiring = cycles;
+	int i, j;
+
+	fp = fopen(name, "w");
+	if (fp == NULL)
+	{
+		printf("couldn't open file %s\n", name);
+		exit(1);
+	}
+	for (j = 0; j < SP_NR_BUBBLE_CAUSES; j++)
+		retiring -= sp->lost_cycles[j];
+
+	fprintf(fp, "program %s\n", sp->program_name);
+	fprintf(fp, "cycles %u\n", cycles);
+	fprintf(fp, "retiring %u %.2f%%\n", retiring, cycles ? 100.0 * retiring / cycles : 0.0);
+	for (j = 0; j < SP_NR_BUBBLE_CAUSES; j++)
+		fprintf(fp, "lost_%s %u %.2f%%\n", bubble_cause_name[j], sp->lost_cycles[j],
+				cycles ? 100.0 * sp->lost_cycles[j] / cycles : 0.0);
+
+	fprintf(fp, "\n%-12s", "stage");
+	for (j = 0; j < SP_NR_BUBBLE_CAUSES; j++)
+		fprintf(fp, " %12s", bubble_cause_name[j]);
+	fprintf(fp, "\n");
+	for (i = 0; i < SP_NR_STAGES; i++) {
+		fprintf(fp, "%-12s", stage_name[i]);
+		for (j = 0; j < SP_NR_BUBBLE_CAUSES; j++)
+			fprintf(fp, " %12u", sp->bubbles[i][j]);
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+}
+
+/* This method moves the sequence numbers down the pipeline together with the instructions.
+   fetch0 holds a newly fetched instruction unless it waits for the icache, dec0 is held on a load after store */
+static void track_seq(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn, bool *is_held) {
+	int active[SP_NR_STAGES] = {sprn->fetch0_active, sprn->fetch1_active, sprn->dec0_active,
+								sprn->dec1_active, sprn->exec0_active, sprn->exec1_active};
+	int i;
+
+	for (i = SP_NR_STAGES - 1; i >= 0; i--) {
+		if (!active[i])
+			continue;
+		if (is_held[i])
+			sprn->seq[i] = spro->seq[i];
+		else if (i == STAGE_FETCH0)
+			sprn->seq[i] = sp->next_seq++;
+		else
+			sprn->seq[i] = spro->seq[i - 1];
+	}
+}
+
+/* This method emits the stage changes of the current cycle in Kanata format */
+static void pipeview_cycle(sp_t *sp, sp_registers_t *spro) {
+	int active[SP_NR_STAGES] = {spro->fetch0_active, spro->fetch1_active, spro->dec0_active,
+								spro->dec1_active, spro->exec0_active, spro->exec1_active};
+	int i, j, seq, inst, still_there;
+
+	// instructions that left the pipeline: the one in exec1 retired, the others were flushed
+	for (i = 0; i < SP_NR_STAGES; i++) {
+		if (!sp->pv_active[i])
+			continue;
+		still_there = 0;
+		for (j = 0; j < SP_NR_STAGES; j++)
+			if (active[j] && spro->seq[j] == sp->pv_seq[i])
+				still_there = 1;
+		if (still_there)
+			continue;
+		if (i == STAGE_EXEC1)
+			fprintf(sp->pipeview_fp, "R\t%d\t%d\t0\n", sp->pv_seq[i], sp->pv_retired++);
+		else
+			fprintf(sp->pipeview_fp, "R\t%d\t0\t1\n", sp->pv_seq[i]);
+	}
+
+	for (i = 0; i < SP_NR_STAGES; i++) {
+		if (!active[i])
+			continue;
+		seq = spro->seq[i];
+		if (seq > sp->pv_last_seq) { // new instruction
+			inst = llsim_mem_extract(sp->srami, spro->fetch0_pc, 31, 0);
+			fprintf(sp->pipeview_fp, "I\t%d\t%d\t0\n", seq, seq);
+			fprintf(sp->pipeview_fp, "L\t%d\t0\t%04x: %08x %s\n", seq, spro->fetch0_pc, inst, opcode_name[sbs(inst, 29, 25)]);
+			sp->pv_last_seq = seq;
+		}
+		for (j = 0; j < SP_NR_STAGES; j++)
+			if (sp->pv_active[j] && sp->pv_seq[j] == seq)
+				break;
+		if (j != i)
+			fprintf(sp->pipeview_fp, "S\t%d\t0\t%s\n", seq, stage_name[i]);
+	}
+
+	for (i = 0; i < SP_NR_STAGES; i++) {
+		sp->pv_active[i] = active[i];
+		sp->pv_seq[i] = spro->seq[i];
+	}
+	fprintf(sp->pipeview_fp, "C\t1\n");
+}
+
+/* This method closes the pipeline view, the instruction in exec1 retired in the last cycle */
+static void pipeview_finish(sp_t *sp) {
+	int i;
+
+	for (i = 0; i < SP_NR_STAGES; i++) {
+		if (!sp->pv_active[i])
+			continue;
+		if (i == STAGE_EXEC1)
+			fprintf(sp->pipeview_fp, "R\t%d\t%d\t0\n", sp->pv_seq[i], sp->pv_retired++);
+		else
+			fprintf(sp->pipeview_fp, "R\t%d\t0\t1\n", sp->pv_seq[i]);
+	}
+	fclose(sp->pipeview_fp);
+}
+
+/* This method is called for every srami fetch and every sramd access of LD, ST, the atomics and the DMA */
+static void record_access(sp_t *sp, int source, int addr) {
+	addr &= SP_SRAM_HEIGHT - 1; // LD and ST pass the raw address, the memory asserts on its range later
+	if (sp->srami_sd)
+		llsim_stackdist_access(source == ACCESS_FETCH ? sp->srami_sd : sp->sramd_sd, addr);
+
+	if (sp->heatmap) {
+		sp_heatmap_t *hm = sp->heatmap;
+		int stride = addr - hm->last_addr[source];
+
+		if (source == ACCESS_FETCH)
+			hm->fetches[addr]++;
+		else if (source == ACCESS_ST || source == ACCESS_DMA_WRITE)
+			hm->writes[addr]++;
+		else
+			hm->reads[addr]++;
+		if (hm->accesses[source]++ > 0)
+			hm->strides[source][(stride >= -HEATMAP_MAX_STRIDE && stride <= HEATMAP_MAX_STRIDE) ? stride + HEATMAP_MAX_STRIDE : 2 * HEATMAP_MAX_STRIDE + 1]++;
+		hm->last_addr[source] = addr;
+	}
+}
+
+/* This method writes the non zero counters of one heatmap array as (address, count) pairs */
+static void dump_heatmap_array(FILE *fp, unsigned int *counts) {
+	unsigned int nr_entries = 0;
+	unsigned int entry[2];
+	int addr;
+
+	for (addr = 0; addr < SP_SRAM_HEIGHT; addr++)
+		nr_entries += counts[addr] != 0;
+	fwrite(&nr_entries, sizeof(nr_entries), 1, fp);
+	for (addr = 0; addr < SP_SRAM_HEIGHT; addr++) {
+		if (!counts[addr])
+			continue;
+		entry[0] = addr;
+		entry[1] = counts[addr];
+		fwrite(entry, sizeof(entry), 1, fp);
+	}
+}
+
+/* This method writes the hottest blocks of one memory, sorted by accesses */
+static void report_hot_blocks(FILE *fp, char *name, unsigned int *counts0, unsigned int *counts1, int block_size) {
+	int nr_blocks = (SP_SRAM_HEIGHT) / block_size;
+	unsigned int *blocks = llsim_malloc(nr_blocks * sizeof(unsigned int));
+	int addr, i, j, best;
+
+	for (addr = 0; addr < SP_SRAM_HEIGHT; addr++)
+		blocks[addr / block_size] += counts0[addr] + (counts1 ? counts1[addr] : 0);
+	fprintf(fp, "%s hottest %d word blocks:\n", name, block_size);
+	for (i = 0; i < HEATMAP_TOP; i++) {
+		best = 0;
+		for (j = 1; j < nr_blocks; j++)
+			if (blocks[j] > blocks[best])
+				best = j;
+		if (blocks[best] == 0)
+			break;
+		fprintf(fp, "  %04x-%04x %u\n", best * block_size, (best + 1) * block_size - 1, blocks[best]);
+		blocks[best] = 0;
+	}
+	free(blocks);
+}
+
+/* This method writes the binary heatmap and the text report of hot ranges and strides */
+static void dump_heatmap(sp_t *sp, char *bin_name, char *report_name) {
+	sp_heatmap_t *hm = sp->heatmap;
+	FILE *fp;
+	unsigned int height = SP_SRAM_HEIGHT;
+	unsigned int strides[2 * HEATMAP_MAX_STRIDE + 2];
+	int source, i, j, best;
+
+	fp = fopen(bin_name, "wb");
+	if (fp == NULL)
+	{
+		printf("couldn't open file %s\n", bin_name);
+		exit(1);
+	}
+	fwrite("SPHEAT1", 8, 1, fp);
+	fwrite(&height, sizeof(height), 1, fp);
+	dump_heatmap_array(fp, hm->reads);
+	dump_heatmap_array(fp, hm->writes);
+	dump_heatmap_array(fp, hm->fetches);
+	fclose(fp);
+
+	fp = fopen(report_name, "w");
+	if (fp == NULL)
+	{
+		printf("couldn't open file %s\n", report_name);
+		exit(1);
+	}
+	report_hot_blocks(fp, "sramd", hm->reads, hm->writes, hm->block_size);
+	report_hot_blocks(fp, "srami", hm->fetches, NULL, hm->block_size);
+	for (source = 0; source < SP_NR_ACCESS_SOURCES; source++) {
+		fprintf(fp, "%s accesses %u, top strides:", access_source_name[source], hm->accesses[source]);
+		memcpy(strides, hm->strides[source], sizeof(strides));
+		for (i = 0; i < HEATMAP_TOP; i++) {
+			best = 0;
+			for (j = 1; j < 2 * HEATMAP_MAX_STRIDE + 2; j++)
+				if (strides[j] > strides[best])
+					best = j;
+			if (strides[best] == 0)
+				break;
+			if (best == 2 * HEATMAP_MAX_STRIDE + 1)
+				fprintf(fp, " other %u", strides[best]);
+			else
+				fprintf(fp, " %+d %u", best - HEATMAP_MAX_STRIDE, strides[best]);
+			strides[best] = 0;
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+}
+
 /* This methods checks if the opcode represents a branch operation */
 static bool is_branch_operation(int opcode) {
 
 	return opcode == JLT || opcode == JLE || opcode == JEQ || opcode == JNE || opcode == JIN;
 }
 
-/* This methods checks the branch history and if the branch should be taken, flushed the pipeline */
-static void handle_branch_prediction(sp_registers_t *spro, sp_registers_t *sprn) {
+/* This methods checks if the opcode is an atomic read-modify-write. It reads SRAMD in exec0
+   like LD and writes it in exec1 like ST */
+static bool is_atomic_operation(int opcode) {
+
+	return opcode == SWP || opcode == CAS || opcode == FAA;
+}
+
+/* This methods checks if the opcode reads SRAMD, the data arrives in exec1 */
+static bool is_mem_read_operation(int opcode) {
+
+	return opcode == LD || is_atomic_operation(opcode);
+}
+
+/* This methods checks if the opcode writes SRAMD in exec1 */
+static bool is_mem_write_operation(int opcode) {
+
+	return opcode == ST || is_atomic_operation(opcode);
+}
+
+/* This methods checks if the opcode writes dst with a value known only in exec1,
+   which the bypasses take from the memory or the mailbox */
+static bool is_load_operation(int opcode) {
+
+	return is_mem_read_operation(opcode) || opcode == RCV;
+}
+
+static bool is_mem_operation(int opcode) {
+
+	return is_mem_read_operation(opcode) || is_mem_write_operation(opcode);
+}
+
+/* This methods checks if the opcode runs on the multi-cycle multiply and divide unit */
+static bool is_muldiv_operation(int opcode) {
+
+	return opcode == MUL || opcode == MULH || opcode == DIV || opcode == REM;
+}
+
+/* This method computes MUL, MULH, DIV and REM. Division by 0 gives -1 and the dividend
+   as remainder, the overflowing INT_MIN / -1 gives INT_MIN and remainder 0 */
+static int muldiv_result(int opcode, int a, int b) {
+	switch (opcode) {
+	case MUL:
+		return (int) ((unsigned int) a * (unsigned int) b);
+	case MULH:
+		return (int) (((i64) a * b) >> 32);
+	case DIV:
+		if (b == 0)
+			return -1;
+		return (b == -1) ? (int) (0 - (unsigned int) a) : a / b;
+	case REM:
+		if (b == 0)
+			return a;
+		return (b == -1) ? 0 : a % b;
+	}
+	return 0;
+}
+
+/* This methods checks if the opcode writes an ALU result to dst in exec1 (bypassable from exec1_aluout) */
+static bool is_reg_write_operation(int opcode) {
+
+	return opcode == ADD || opcode == SUB || opcode == LSF || opcode == RSF || opcode == AND ||
+		   opcode == OR || opcode == XOR || opcode == LHI || opcode == CPY || opcode == POL || opcode == CNT ||
+		   is_muldiv_operation(opcode);
+}
+
+/* This methods checks the branch history and if the branch should be taken, flushed the pipeline.
+   Returns true if the pipeline was flushed */
+static bool handle_branch_prediction(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn) {
 	int pc = spro->dec0_pc;
-	if (branch_hist[pc % branch_hist_SIZE] > PREDICT_WEAK_NT) { // branch is taken, we need to flush the pipeline
+	if (sp->branch_hist[pc % branch_hist_SIZE] > PREDICT_WEAK_NT) { // branch is taken, we need to flush the pipeline
 		sprn->fetch0_pc = pc;
 		sprn->dec0_active = 0;
 		sprn->fetch1_active = 0;
 		sprn->fetch0_active = 1;
+		return true;
 	}
+	return false;
 }
 
 /* This methods handles the DMA in exec0 */
@@ -215,10 +927,7 @@ static void handle_exec0_dma(sp_registers_t *sprn, sp_registers_t *spro) {
 	{
 		// read after write for src0
 		if (spro->exec1_active && spro->exec1_dst == spro->exec0_src0 &&
-			(spro->exec1_opcode == ADD || spro->exec1_opcode == SUB || spro->exec1_opcode == AND ||
-			 spro->exec1_opcode == OR || spro->exec1_opcode == XOR || spro->exec1_opcode == LSF ||
-			 spro->exec1_opcode == RSF || spro->exec1_opcode == LHI ||
-			 spro->exec1_opcode == CPY || spro->exec1_opcode == POL))
+			is_reg_write_operation(spro->exec1_opcode))
 		{
 			sprn->dma_source = spro->exec1_aluout;
 		}
@@ -229,10 +938,7 @@ static void handle_exec0_dma(sp_registers_t *sprn, sp_registers_t *spro) {
 
 		// read after write for src1
 		if (spro->exec1_active && spro->exec1_dst == spro->exec0_src1 &&
-			(spro->exec1_opcode == ADD || spro->exec1_opcode == SUB || spro->exec1_opcode == AND ||
-			 spro->exec1_opcode == OR || spro->exec1_opcode == XOR || spro->exec1_opcode == LSF ||
-			 spro->exec1_opcode == RSF || spro->exec1_opcode == LHI ||
-			 spro->exec1_opcode == CPY || spro->exec1_opcode == POL))
+			is_reg_write_operation(spro->exec1_opcode))
 		{
 			sprn->dma_remain = spro->exec1_aluout;
 			sprn->dma_length = spro->exec1_aluout;
@@ -247,11 +953,121 @@ static void handle_exec0_dma(sp_registers_t *sprn, sp_registers_t *spro) {
 	}
 }
 
+/* This method tells if the core needs its SRAMD port this clock: a LD or atomic in exec0,
+   a ST or atomic in exec1 or a DMA transfer. It looks at the registers only, so every core may ask */
+static bool sp_bus_request(sp_registers_t *spro) {
+	return (spro->exec0_active && is_mem_read_operation(spro->exec0_opcode)) ||
+		   (spro->exec1_active && is_mem_write_operation(spro->exec1_opcode)) || spro->dma_state != DMA_STATE_IDLE;
+}
+
+/* This method tells if the core holds the bus between the read and the write of a DMA word
+   or of an atomic, whose read in exec0 was granted */
+static bool sp_bus_locked(sp_registers_t *spro) {
+	return spro->dma_state == DMA_STATE_ACTIVE || (spro->exec1_active && is_atomic_operation(spro->exec1_opcode));
+}
+
+/* This method picks the core whose SRAMD port is served this clock, -1 for none.
+   A locked bus stays with its core */
+static int sp_bus_winner(void) {
+	int i, id, first;
+
+	for (i = 0; i < sp_bus->nr_cores; i++)
+		if (sp_bus_locked(sp_bus->cores[i]->spro))
+			return i;
+	first = sp_bus->is_round_robin ? *sp_bus->last_old + 1 : 0;
+	for (i = 0; i < sp_bus->nr_cores; i++) {
+		id = (first + i) % sp_bus->nr_cores;
+		if (sp_bus_request(sp_bus->cores[id]->spro))
+			return id;
+	}
+	return -1;
+}
+
+static void sp_bus_run(llsim_unit_t *unit)
+{
+	int winner;
+
+	if (llsim->reset) {
+		llsim_idle_until(unit, LLSIM_IDLE_FOREVER);
+		return;
+	}
+	winner = sp_bus_winner();
+	if (winner >= 0)
+		*sp_bus->last_new = winner;
+}
+
+/* This method returns the number of words core id may receive this clock, its pop of the
+   last clock is not applied yet */
+static int sp_mbox_available(int id) {
+	return MBOX_COUNT(sp_mbox->old, id) - sp_bus->cores[id]->spro->mbox_pop;
+}
+
+/* This method tells if the SND in exec1 of core id has no room this clock. The pushes of
+   the last clock and the SNDs of lower cores to the same mailbox, which go first, take room */
+static bool sp_mbox_is_full(int id) {
+	sp_registers_t *spro = sp_bus->cores[id]->spro, *other;
+	int target = spro->exec1_alu1, used, i;
+
+	llsim_assert(target >= 0 && target < sp_bus->nr_cores, "sp%d: SND to core %d at pc %04x, there are %d cores\n",
+				 id, target, spro->exec1_pc, sp_bus->nr_cores);
+	used = MBOX_COUNT(sp_mbox->old, target);
+	for (i = 0; i < sp_bus->nr_cores; i++) {
+		other = sp_bus->cores[i]->spro;
+		if (other->mbox_push && other->mbox_push_core == target)
+			used++;
+		if (i < id && other->exec1_active && other->exec1_opcode == SND && other->exec1_alu1 == target)
+			used++;
+	}
+	return used >= sp_mbox->depth;
+}
+
+/* This method returns the word RCV of core id gets this clock */
+static int sp_mbox_head(int id) {
+	return MBOX_DATA(sp_mbox->old, id, MBOX_HEAD(sp_mbox->old, id) + sp_bus->cores[id]->spro->mbox_pop);
+}
+
+/* This method checks if SND or RCV in exec1 has to wait for the mailbox */
+static bool is_mbox_wait_needed(sp_t *sp, sp_registers_t *spro) {
+	if (!spro->exec1_active)
+		return false;
+	if (spro->exec1_opcode == RCV)
+		return sp_mbox_available(sp->id) == 0;
+	if (spro->exec1_opcode == SND)
+		return sp_mbox_is_full(sp->id);
+	return false;
+}
+
+static void sp_mbox_run(llsim_unit_t *unit)
+{
+	sp_registers_t *spro;
+	int i, target;
+
+	if (llsim->reset) {
+		llsim_idle_until(unit, LLSIM_IDLE_FOREVER);
+		return;
+	}
+	for (i = 0; i < sp_bus->nr_cores; i++) {
+		spro = sp_bus->cores[i]->spro;
+		if (spro->mbox_pop) {
+			MBOX_HEAD(sp_mbox->new, i) = (MBOX_HEAD(sp_mbox->new, i) + 1) % sp_mbox->depth;
+			MBOX_COUNT(sp_mbox->new, i)--;
+		}
+	}
+	for (i = 0; i < sp_bus->nr_cores; i++) {
+		spro = sp_bus->cores[i]->spro;
+		if (spro->mbox_push) {
+			target = spro->mbox_push_core;
+			MBOX_DATA(sp_mbox->new, target, MBOX_HEAD(sp_mbox->new, target) + MBOX_COUNT(sp_mbox->new, target)) = spro->mbox_push_data;
+			MBOX_COUNT(sp_mbox->new, target)++;
+		}
+	}
+}
+
 /* This methods handles the DMA in exec1 */
 static void handle_exec1_dma(sp_t *sp, int is_mem_busy) {
 	if (sp->spro->dma_state == DMA_STATE_IDLE)
 	{
-		if (is_dma_active && !is_mem_busy)
+		if (sp->is_dma_active && !is_mem_busy)
 		{
 			sp->sprn->dma_state = DMA_STATE_WAIT;
 			sp->sprn->is_dma_busy = 1;
@@ -261,14 +1077,28 @@ static void handle_exec1_dma(sp_t *sp, int is_mem_busy) {
 	}
 	else if (sp->spro->dma_state == DMA_STATE_WAIT)
 	{
+		if (!sp->is_bus_granted) // another core has the shared SRAMD
+			return;
+		if (sp->dcache)
+			llsim_cache_snoop(sp->dcache, sp->spro->dma_source & (SP_SRAM_HEIGHT - 1), 0);
 		llsim_mem_read(sp->sramd, sp->spro->dma_source);
+		record_access(sp, ACCESS_DMA_READ, sp->spro->dma_source);
 		sp->sprn->dma_state = DMA_STATE_ACTIVE;
 	}
 	else if (sp->spro->dma_state == DMA_STATE_ACTIVE)
 	{
+		if (!llsim_mem_dataout_ready(sp->sramd)) // slow memory, read still in flight
+			return;
+
 		int dataout = llsim_mem_extract_dataout(sp->sramd, 31, 0);
 		llsim_mem_set_datain(sp->sramd, dataout, 31, 0);
 		llsim_mem_write(sp->sramd, sp->spro->dma_destination);
+		record_access(sp, ACCESS_DMA_WRITE, sp->spro->dma_destination);
+		if (sp->dcache)
+			llsim_cache_snoop(sp->dcache, sp->spro->dma_destination & (SP_SRAM_HEIGHT - 1), 1);
+
+		if (sp->ref) // the dma engine is outside the reference model, it follows its writes
+			sp->ref->dmem[sp->spro->dma_destination & ((SP_SRAM_HEIGHT) - 1)] = dataout;
 
 		sp->sprn->dma_remain = sp->spro->dma_remain - 1;
 		sp->sprn->dma_destination = sp->spro->dma_destination + 1;
@@ -278,7 +1108,7 @@ static void handle_exec1_dma(sp_t *sp, int is_mem_busy) {
 		{
 			sp->sprn->is_dma_busy = 0;
 			sp->sprn->dma_state = DMA_STATE_IDLE;
-			is_dma_active = 0;
+			sp->is_dma_active = 0;
 		}
 		else
 		{
@@ -300,9 +1130,11 @@ static void handle_load_after_store(sp_registers_t *spro, sp_registers_t *sprn)
 	sprn->fetch1_active = 0;
 	sprn->dec1_active = 0;
 
-	// fetch1 should return to instruction in fetch0
-	sprn->fetch0_active = spro->fetch1_active;
-	sprn->fetch0_pc = spro->fetch1_pc;
+	// fetch1 should return to instruction in fetch0, an empty fetch1 (icache miss) leaves fetch0 waiting
+	if (spro->fetch1_active) {
+		sprn->fetch0_active = 1;
+		sprn->fetch0_pc = spro->fetch1_pc;
+	}
 
 	// repeating the current stage again
 	sprn->dec0_pc = spro->dec0_pc;
@@ -310,39 +1142,96 @@ static void handle_load_after_store(sp_registers_t *spro, sp_registers_t *sprn)
 	sprn->dec0_active = spro->dec0_active;
 }
 
+/* This method checks if the pipeline has to wait for a multi-cycle SRAMD read.
+   A LD or atomic in exec1 waits for a data cache miss and for its data, and a LD or atomic in exec0 or ST in exec1 waits
+   for the memory port while the DMA has a transfer in flight or another core has the bus */
+static bool is_load_use_stall_needed(sp_t *sp, sp_registers_t *spro) {
+	bool is_port_busy = !llsim_mem_dataout_ready(sp->sramd) || spro->dma_state != DMA_STATE_IDLE || !sp->is_bus_granted;
+
+	if (spro->exec1_active && is_mem_read_operation(spro->exec1_opcode) && sp->dcache_load_stall > 0) {
+		if (--sp->dcache_load_stall == 0) // the line is filled, the read goes to SRAMD
+			llsim_mem_read(sp->sramd, spro->exec1_alu1);
+		return true;
+	}
+	if (spro->exec1_active && is_mem_read_operation(spro->exec1_opcode) && !llsim_mem_dataout_ready(sp->sramd))
+		return true;
+	if (spro->exec1_active && spro->exec1_opcode == ST && is_port_busy)
+		return true;
+	if (spro->exec0_active && is_mem_read_operation(spro->exec0_opcode) && is_port_busy)
+		return true;
+	return false;
+}
+
+/* This method looks up the fetch pc in the instruction cache. A miss blocks fetch0 for the
+   miss latency, a fill that started keeps going even if fetch0 is redirected meanwhile */
+static bool is_icache_miss(sp_t *sp, int pc) {
+	if (sp->icache == NULL)
+		return false;
+	if (sp->icache_stall == 0)
+		sp->icache_stall = llsim_cache_access(sp->icache, pc, 0);
+	if (sp->icache_stall > 0) {
+		sp->icache_stall--;
+		return true;
+	}
+	return false;
+}
+
+/* This method advances the multiply and divide unit. A MUL or MULH stays in exec0 for
+   mul_latency cycles, a DIV or REM for div_latency cycles, and the pipeline waits behind it.
+   The unit keeps counting while the pipeline waits for something else */
+static bool is_muldiv_busy(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn) {
+	int latency;
+
+	if (!spro->exec0_active || !is_muldiv_operation(spro->exec0_opcode) || sp->is_dma_done)
+		return false;
+	latency = (spro->exec0_opcode == MUL || spro->exec0_opcode == MULH) ? sp->mul_latency : sp->div_latency;
+	if (spro->muldiv_cycles + 1 >= latency)
+		return false;
+	sprn->muldiv_cycles = spro->muldiv_cycles + 1;
+	return true;
+}
+
+/* This method holds the pipeline while a store miss of the data cache is served */
+static bool is_dcache_store_stall(sp_t *sp) {
+	if (sp->dcache_stall == 0)
+		return false;
+	sp->dcache_stall--;
+	return true;
+}
+
 /* This method updates the branch history according to branch resolution */
-static void update_branch_history(sp_registers_t *spro, sp_registers_t *sprn, bool is_branch_taken) {
+static void update_branch_history(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn, bool is_branch_taken) {
 	int pc = spro->exec1_pc;
 	if (is_branch_taken) { // if branch is taken
 		sprn->r[7] = pc;
-		switch (branch_hist[pc % branch_hist_SIZE]) {
+		switch (sp->branch_hist[pc % branch_hist_SIZE]) {
 			case(PREDICT_STRONG_NT):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_NT;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_NT;
 				break;
 			case(PREDICT_WEAK_NT):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_T;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_T;
 				break;
 			case(PREDICT_WEAK_T):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_T;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_T;
 				break;
 			case(PREDICT_STRONG_T):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_T;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_T;
 				break;
 		}
 	}
 	else { // if branch is not taken
-		switch (branch_hist[pc % branch_hist_SIZE]) {
+		switch (sp->branch_hist[pc % branch_hist_SIZE]) {
 			case(PREDICT_STRONG_NT):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_NT;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_NT;
 				break;
 			case(PREDICT_WEAK_NT):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_NT;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_STRONG_NT;
 				break;
 			case(PREDICT_WEAK_T):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_NT;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_NT;
 				break;
 			case(PREDICT_STRONG_T):
-				branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_T;
+				sp->branch_hist[pc % branch_hist_SIZE] = PREDICT_WEAK_T;
 				break;
 		}
 	}
@@ -371,6 +1260,13 @@ static bool check_if_flush_is_needed(sp_registers_t* spro, int next_pc) {
 	}
 }
 
+/* This method returns the value a load operation in exec1 writes to dst */
+static int exec1_load_value(sp_t *sp, sp_registers_t *spro) {
+	if (spro->exec1_opcode == RCV)
+		return sp_mbox_head(sp->id);
+	return llsim_mem_extract_dataout(sp->sramd, 31, 0);
+}
+
 /* This method decides the value of exec0_alu0 while taking into account
    Bypasses and branch taken */
 static void decide_exec0_alu0_value(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn) {
@@ -383,16 +1279,14 @@ static void decide_exec0_alu0_value(sp_t *sp, sp_registers_t *spro, sp_registers
 	}
 
 	else if (spro->exec1_active && spro->dec1_src0 == spro->exec1_dst &&
-			 (spro->exec1_opcode == ADD || spro->exec1_opcode == SUB || spro->exec1_opcode == LSF ||
-			  spro->exec1_opcode == RSF || spro->exec1_opcode == AND || spro->exec1_opcode == OR ||
-			  spro->exec1_opcode == XOR || spro->exec1_opcode == LHI || spro->exec1_opcode == POL || spro->exec1_opcode == CPY))
+			 is_reg_write_operation(spro->exec1_opcode))
 	{ // read after write bypass (ALU)
 		sprn->exec0_alu0 = spro->exec1_aluout;
 	}
 
-	else if (spro->exec1_active && spro->exec1_opcode == LD && spro->exec1_dst == spro->dec1_src0)
+	else if (spro->exec1_active && is_load_operation(spro->exec1_opcode) && spro->exec1_dst == spro->dec1_src0)
 	{ // read after write bypass (MEM)
-		sprn->exec0_alu0 = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+		sprn->exec0_alu0 = exec1_load_value(sp, spro);
 	}
 
 	else if (spro->exec1_active && spro->exec1_aluout == 1 && spro->dec1_src0 == 7 &&
@@ -419,16 +1313,14 @@ static void decide_exec0_alu1_value(sp_t *sp, sp_registers_t *spro, sp_registers
 	}
 
 	else if (spro->exec1_active && spro->dec1_src1 == spro->exec1_dst &&
-			 (spro->exec1_opcode == ADD || spro->exec1_opcode == SUB || spro->exec1_opcode == LSF ||
-			  spro->exec1_opcode == RSF || spro->exec1_opcode == AND || spro->exec1_opcode == OR ||
-			  spro->exec1_opcode == XOR || spro->exec1_opcode == LHI || spro->exec1_opcode == POL || spro->exec1_opcode == CPY))
+			 is_reg_write_operation(spro->exec1_opcode))
 	{ // read after write bypass (ALU)
 		sprn->exec0_alu1 = spro->exec1_aluout;
 	}
 
-	else if (spro->exec1_active && spro->exec1_opcode == LD && spro->exec1_dst == spro->dec1_src1)
+	else if (spro->exec1_active && is_load_operation(spro->exec1_opcode) && spro->exec1_dst == spro->dec1_src1)
 	{ // read after write bypass (MEM)
-		sprn->exec0_alu1 = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+		sprn->exec0_alu1 = exec1_load_value(sp, spro);
 	}
 
 	else if (spro->exec1_active && spro->exec1_aluout == 1 && spro->dec1_src1 == 7 &&
@@ -462,8 +1354,23 @@ static int decide_exec1_aluout_value(sp_t *sp, sp_registers_t *spro, sp_register
 		return alu0 ^ alu1;
 	case LHI:
 		return (alu1 << ALU1_SHIFT) + (alu0 & LOWER_16_BITS_MASK);
+	case MUL:
+	case MULH:
+	case DIV:
+	case REM:
+		return muldiv_result(spro->exec0_opcode, alu0, alu1);
 	case LD:
-		llsim_mem_read(sp->sramd, alu1);
+	case SWP:
+	case CAS:
+	case FAA:
+		if (sp->dcache) { // a miss delays the read, see is_load_use_stall_needed()
+			// the raw address indexes the cache sets, keep it in the memory like record_access()
+			sp->dcache_load_stall = llsim_cache_access(sp->dcache, alu1 & (SP_SRAM_HEIGHT - 1), 0);
+			sp->counters[CNT_DCACHE_STALL] += sp->dcache_load_stall;
+		}
+		if (sp->dcache_load_stall == 0)
+			llsim_mem_read(sp->sramd, alu1);
+		record_access(sp, ACCESS_LD, alu1);
 		return 0;
 	case JLT:
 		return (alu0 < alu1) ? 1 : 0;
@@ -479,6 +1386,8 @@ static int decide_exec1_aluout_value(sp_t *sp, sp_registers_t *spro, sp_register
 		return 0;
 	case POL:
 		return spro->dma_remain;
+	case CNT:
+		return (alu1 >= 0 && alu1 < SP_NR_COUNTERS) ? sp->counters[alu1] : 0;
 	}
 	return 0;
 }
@@ -488,16 +1397,14 @@ static int decide_exec1_aluout_value(sp_t *sp, sp_registers_t *spro, sp_register
 static void decide_exec1_alu0_value(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn, int *alu0) {
 	if (spro->exec0_src0 != 0 && spro->exec0_src0 != 1) { // not r0 or imm
 		if (spro->exec1_active && spro->exec1_dst == spro->exec0_src0 &&
-			(spro->exec1_opcode == ADD || spro->exec1_opcode == SUB || spro->exec1_opcode == AND ||
-			 spro->exec1_opcode == OR || spro->exec1_opcode == XOR || spro->exec1_opcode == LSF ||
-			 spro->exec1_opcode == RSF || spro->exec1_opcode == LHI || spro->exec1_opcode == POL || spro->exec1_opcode == CPY))
+			is_reg_write_operation(spro->exec1_opcode))
 		{ // read after write bypass (ALU)
 			*alu0 = spro->exec1_aluout;
 		}
 
-		else if (spro->exec1_active && spro->exec1_opcode == LD && spro->exec0_src0 == spro->exec1_dst)
+		else if (spro->exec1_active && is_load_operation(spro->exec1_opcode) && spro->exec0_src0 == spro->exec1_dst)
 		{ // read after write bypass (MEM)
-			*alu0 = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+			*alu0 = exec1_load_value(sp, spro);
 		}
 
 		else if (spro->exec1_active && spro->exec0_src0 == 7 &&
@@ -514,16 +1421,14 @@ static void decide_exec1_alu0_value(sp_t *sp, sp_registers_t *spro, sp_registers
 static void decide_exec1_alu1_value(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn, int* alu1) {
 	if (spro->exec0_src1 != 0 && spro->exec0_src1 != 1) { // not r0 or imm
 		if (spro->exec1_active && spro->exec1_dst == spro->exec0_src1 &&
-			(spro->exec1_opcode == ADD || spro->exec1_opcode == SUB || spro->exec1_opcode == AND ||
-			 spro->exec1_opcode == OR || spro->exec1_opcode == XOR || spro->exec1_opcode == LSF ||
-			 spro->exec1_opcode == RSF || spro->exec1_opcode == LHI || spro->exec1_opcode == POL || spro->exec1_opcode == CPY))
+			is_reg_write_operation(spro->exec1_opcode))
 		{ // read after write bypass (ALU)
 			*alu1 = spro->exec1_aluout;
 		}
 
-		else if (spro->exec1_active && spro->exec1_opcode == LD && spro->exec0_src1 == spro->exec1_dst)
+		else if (spro->exec1_active && is_load_operation(spro->exec1_opcode) && spro->exec0_src1 == spro->exec1_dst)
 		{ // read after write bypass (MEM)
-			*alu1 = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+			*alu1 = exec1_load_value(sp, spro);
 		}
 
 		else if (spro->exec1_active && spro->exec0_src1 == 7 &&
@@ -535,139 +1440,560 @@ static void decide_exec1_alu1_value(sp_t *sp, sp_registers_t *spro, sp_registers
 	}
 }
 
+/*
+ * trace index files: "LLSIMIX1", then per trace record a u32 cycle or instruction number,
+ * the u32 pc (-1 for an empty pipeline) and the u64 offset of the record in the trace
+ */
+static FILE *open_trace_index(char *name) {
+	FILE *fp;
+
+	fp = fopen(name, "wb");
+	if (fp == NULL)
+	{
+		printf("couldn't open file %s\n", name);
+		exit(1);
+	}
+	fwrite("LLSIMIX1", 8, 1, fp);
+	return fp;
+}
+
+static void write_trace_index(FILE *fp, int number, int pc, long long offset) {
+	fwrite(&number, 4, 1, fp);
+	fwrite(&pc, 4, 1, fp);
+	fwrite(&offset, 8, 1, fp);
+}
+
+/* This method returns the value CAS compares with. Every older instruction has written back,
+   so dst is read from the register file in exec1 */
+static int atomic_expected(sp_registers_t *spro) {
+	if (spro->exec1_dst == 0)
+		return 0;
+	if (spro->exec1_dst == 1)
+		return spro->exec1_immediate;
+	return spro->r[spro->exec1_dst];
+}
+
 /* This method prints the instructions trace file */
 static void trace_inst_to_file(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn) {
-	fprintf(inst_trace_fp,"--- instruction %i (%04x) @ PC %i (%04x) -----------------------------------------------------------\n", inst_cnt, inst_cnt, spro->exec1_pc, spro->exec1_pc);
-	fprintf(inst_trace_fp,"pc = %04d, inst = %08x, opcode = %i (%s), dst = %i, src0 = %i, src1 = %i, immediate = %08x\n", spro->exec1_pc, spro->exec1_inst, spro->exec1_opcode, opcode_name[spro->exec1_opcode],
+	if (sp->inst_index_fp && sp->inst_trace_on)
+		write_trace_index(sp->inst_index_fp, sp->inst_cnt, spro->exec1_pc, sp->inst_trace_bytes);
+	inst_printf(sp,"--- instruction %i (%04x) @ PC %i (%04x) -----------------------------------------------------------\n", sp->inst_cnt, sp->inst_cnt, spro->exec1_pc, spro->exec1_pc);
+	inst_printf(sp,"pc = %04d, inst = %08x, opcode = %i (%s), dst = %i, src0 = %i, src1 = %i, immediate = %08x\n", spro->exec1_pc, spro->exec1_inst, spro->exec1_opcode, opcode_name[spro->exec1_opcode],
 	spro->exec1_dst, spro->exec1_src0, spro->exec1_src1, sbs(spro->exec1_inst, 15, 0));
-	fprintf(inst_trace_fp,"r[0] = 00000000 r[1] = %08x r[2] = %08x r[3] = %08x \n",spro->exec1_immediate, spro->r[2], spro->r[3]);
-	fprintf(inst_trace_fp,"r[4] = %08x r[5] = %08x r[6] = %08x r[7] = %08x \n\n", spro->r[4], spro->r[5], spro->r[6], spro->r[7]);
+	inst_printf(sp,"r[0] = 00000000 r[1] = %08x r[2] = %08x r[3] = %08x \n",spro->exec1_immediate, spro->r[2], spro->r[3]);
+	inst_printf(sp,"r[4] = %08x r[5] = %08x r[6] = %08x r[7] = %08x \n\n", spro->r[4], spro->r[5], spro->r[6], spro->r[7]);
 	
 	if (spro->exec1_opcode == ADD) {
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == SUB)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == LSF)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == RSF)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == AND)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == OR)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == XOR)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
+	else if (is_muldiv_operation(spro->exec1_opcode))
+	{
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+	}
 	else if (spro->exec1_opcode == LHI)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
+		inst_printf(sp, ">>>> EXEC: R[%i] = %i %s %i <<<<\n\n", spro->exec1_dst, spro->exec1_alu0, opcode_name[spro->exec1_opcode], spro->exec1_alu1);
 		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == LD)
 	{
 		int loaded_mem = llsim_mem_extract_dataout(sp->sramd, 31, 0);
-		fprintf(inst_trace_fp, ">>>> EXEC: R[%i] = MEM[%i] = %08x <<<<\n\n", spro->exec1_dst, spro->exec1_alu1, loaded_mem);
+		inst_printf(sp, ">>>> EXEC: R[%i] = MEM[%i] = %08x <<<<\n\n", spro->exec1_dst, spro->exec1_alu1, loaded_mem);
 		sprn->r[spro->exec1_dst] = loaded_mem;
 	}
+	else if (is_atomic_operation(spro->exec1_opcode))
+	{
+		int loaded_mem = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+		inst_printf(sp, ">>>> EXEC: R[%i] = MEM[%i] = %08x, %s %08x", spro->exec1_dst, spro->exec1_alu1, loaded_mem,
+					opcode_name[spro->exec1_opcode], spro->exec1_alu0);
+		if (spro->exec1_opcode == CAS)
+			inst_printf(sp, " if %08x", atomic_expected(spro));
+		inst_printf(sp, " <<<<\n\n");
+	}
+	else if (spro->exec1_opcode == SND)
+	{
+		inst_printf(sp, ">>>> EXEC: MBOX[%i] = %08x <<<<\n\n", spro->exec1_alu1, spro->exec1_alu0);
+	}
+	else if (spro->exec1_opcode == RCV && sp_mbox)
+	{
+		inst_printf(sp, ">>>> EXEC: R[%i] = MBOX[%i] = %08x <<<<\n\n", spro->exec1_dst, sp->id, sp_mbox_head(sp->id));
+	}
 	else if (spro->exec1_opcode == ST)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: MEM[%i] = R[%i] = %08x <<<<\n\n", (spro->exec1_src1 == 1) ? spro->exec1_immediate : spro->r[spro->exec1_src1], spro->exec1_src0, spro->r[spro->exec1_src0]);
+		inst_printf(sp, ">>>> EXEC: MEM[%i] = R[%i] = %08x <<<<\n\n", (spro->exec1_src1 == 1) ? spro->exec1_immediate : spro->r[spro->exec1_src1], spro->exec1_src0, spro->r[spro->exec1_src0]);
 	}
 	else if (spro->exec1_opcode == JLT)
 	{
 		if (spro->exec1_aluout == 1)
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
 			sprn->r[7] = spro->exec1_pc;
 			sprn->fetch0_pc = spro->exec1_immediate;
 		}
 		else
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
 		}
 	}
 	else if (spro->exec1_opcode == JLE)
 	{
 		if (spro->exec1_aluout == 1)
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
 			sprn->r[7] = spro->exec1_pc;
 			sprn->fetch0_pc = spro->exec1_immediate;
 		}
 		else
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
 		}
 	}
 	else if (spro->exec1_opcode == JEQ)
 	{
 		if (spro->exec1_aluout == 1)
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
 			sprn->r[7] = spro->exec1_pc;
 			sprn->fetch0_pc = spro->exec1_immediate;
 		}
 		else
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
 		}
 	}
 	else if (spro->exec1_opcode == JNE)
 	{
 		if (spro->exec1_aluout == 1)
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
 			sprn->r[7] = spro->exec1_pc;
 			sprn->fetch0_pc = spro->exec1_immediate;
 		}
 		else
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
 		}
 	}
 	else if (spro->exec1_opcode == JIN)
 	{
 		if (spro->exec1_aluout == 1)
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_immediate);
 			sprn->r[7] = spro->exec1_pc;
 			sprn->fetch0_pc = spro->exec1_immediate;
 		}
 		else
 		{
-			fprintf(inst_trace_fp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
+			inst_printf(sp, ">>>> EXEC: %s %i, %i, %i <<<<\n\n", opcode_name[spro->exec1_opcode], spro->r[spro->exec1_src0], spro->r[spro->exec1_src1], spro->exec1_pc + 1);
 		}
 	}
 	else if (spro->exec1_opcode == HLT)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: HALT at PC %04x<<<<\n", spro->exec1_pc);
+		inst_printf(sp, ">>>> EXEC: HALT at PC %04x<<<<\n", spro->exec1_pc);
 	}
 	else if (spro->exec1_opcode == POL)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: POL - Remaining copy: %i <<<<\n\n", spro->dma_remain);
+		inst_printf(sp, ">>>> EXEC: POL - Remaining copy: %i <<<<\n\n", spro->dma_remain);
+	}
+	else if (spro->exec1_opcode == CNT)
+	{
+		inst_printf(sp, ">>>> EXEC: R[%i] = CNT[%i] = %08x <<<<\n\n", spro->exec1_dst, spro->exec1_alu1, spro->exec1_aluout);
+		sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 	}
 	else if (spro->exec1_opcode == CPY)
 	{
-		fprintf(inst_trace_fp, ">>>> EXEC: CPY - Source address: %i, Destination address: %i, length: %i <<<<\n\n", spro->dma_source, spro->dma_destination, spro->dma_length);
+		inst_printf(sp, ">>>> EXEC: CPY - Source address: %i, Destination address: %i, length: %i <<<<\n\n", spro->dma_source, spro->dma_destination, spro->dma_length);
+	}
+}
+
+/* This method opens or closes the trace window for the current cycle */
+static void update_trace_window(sp_t *sp, sp_registers_t *spro) {
+	bool is_open, has_pc_range;
+	int pc;
+
+	if (!sp->trace_triggered && spro->exec1_active &&
+		((sp->trace_after_cpy && spro->exec1_opcode == CPY) ||
+		 (sp->trace_st_addr >= 0 && spro->exec1_opcode == ST && spro->exec1_alu1 == sp->trace_st_addr)))
+		sp->trace_triggered = 1;
+
+	is_open = sp->trace_triggered && spro->cycle_counter >= sp->trace_start &&
+			  (sp->trace_end < 0 || spro->cycle_counter <= sp->trace_end);
+
+	// the cycle trace follows the pc at the head of the pipeline, the instruction trace the retiring pc
+	has_pc_range = sp->trace_pc_lo > 0 || sp->trace_pc_hi >= 0;
+	pc = head_pc(spro);
+	sp->cycle_trace_on = sp->cycle_trace && is_open &&
+						 (!has_pc_range || (pc >= sp->trace_pc_lo && (sp->trace_pc_hi < 0 || pc <= sp->trace_pc_hi)));
+	pc = spro->exec1_pc;
+	sp->inst_trace_on = sp->inst_trace && is_open &&
+						(!has_pc_range || (pc >= sp->trace_pc_lo && (sp->trace_pc_hi < 0 || pc <= sp->trace_pc_hi)));
+}
+
+/* This method prints the selected fields of the cycle trace file */
+static void trace_cycle_to_file(sp_t *sp, sp_registers_t *spro) {
+	int i;
+
+	if (sp->cycle_index_fp)
+		write_trace_index(sp->cycle_index_fp, spro->cycle_counter, head_pc(spro), sp->cycle_trace_bytes);
+	sp->cycle_trace_bytes += fprintf(sp->cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
+	for (i = 0; i < sp->nr_cycle_trace_regs; i++)
+		sp->cycle_trace_bytes += fprintf(sp->cycle_trace_fp, "%s %08x\n", sp->cycle_trace_regs[i]->reg_name,
+										 *(int *) sp->cycle_trace_regs[i]->oldp);
+	sp->cycle_trace_bytes += fprintf(sp->cycle_trace_fp, "\n\n\n"); // changes were made to align with example outputs
+}
+
+/* This method prints the first difference between the pipeline and the reference model and stops.
+   regs is the pipeline register file to compare, before or after the retirement */
+static void ref_mismatch(sp_t *sp, sp_registers_t *spro, sp_registers_t *regs, char *what, int pipeline, int reference) {
+	sp_ref_t *ref = sp->ref;
+	int i;
+
+	printf("sp: cosim mismatch at clock %d, instruction %d: %s\n", llsim->clock, sp->inst_cnt, what);
+	printf("  pipeline %08x, reference %08x\n", pipeline, reference);
+	printf("  retiring pc %04x inst %08x %s dst %d src0 %d src1 %d immediate %08x\n", spro->exec1_pc, spro->exec1_inst,
+		   opcode_name[spro->exec1_opcode], spro->exec1_dst, spro->exec1_src0, spro->exec1_src1, spro->exec1_immediate);
+	for (i = 2; i <= 7; i++)
+		printf("  r%d pipeline %08x reference %08x%s\n", i, regs->r[i], ref->r[i], regs->r[i] != ref->r[i] ? " <--" : "");
+	exit(1);
+}
+
+/* This method executes the instruction at the reference pc and compares its effects with the
+   instruction retiring in exec1: pc, instruction, store address and data, and the register file.
+   POL and CNT read timing dependent state, the reference model takes their value from the pipeline.
+   So does CPY, which writes the stale exec1_aluout back to dst; the golden traces depend on that */
+static void ref_retire(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn) {
+	sp_ref_t *ref = sp->ref;
+	int inst, opcode, dst, src0, src1, imm, a, b, next_pc, i;
+	bool is_taken = false;
+
+	if (ref->halted)
+		return;
+	if (spro->exec1_pc != ref->pc)
+		ref_mismatch(sp, spro, spro, "pc", spro->exec1_pc, ref->pc);
+	inst = ref->imem[ref->pc];
+	if (spro->exec1_inst != inst)
+		ref_mismatch(sp, spro, spro, "instruction", spro->exec1_inst, inst);
+
+	opcode = (inst & OPCODE_MASK) >> OPCODE_SHIFT;
+	dst = (inst & DST_MASK) >> DST_SHIFT;
+	src0 = (inst & SRC0_MASK) >> SRC0_SHIFT;
+	src1 = (inst & SRC1_MASK) >> SRC1_SHIFT;
+	imm = ssbs(inst, 15, 0);
+	ref->r[0] = 0;
+	ref->r[1] = imm;
+	a = ref->r[src0];
+	b = ref->r[src1];
+	next_pc = (ref->pc + 1) & LOWER_16_BITS_MASK;
+
+	switch (opcode) {
+	case ADD: ref->r[dst] = a + b; break;
+	case SUB: ref->r[dst] = a - b; break;
+	case LSF: ref->r[dst] = a << b; break;
+	case RSF: ref->r[dst] = a >> b; break;
+	case AND: ref->r[dst] = a & b; break;
+	case OR: ref->r[dst] = a | b; break;
+	case XOR: ref->r[dst] = a ^ b; break;
+	case LHI: ref->r[dst] = (imm << ALU1_SHIFT) + (a & LOWER_16_BITS_MASK); break;
+	case MUL:
+	case MULH:
+	case DIV:
+	case REM: ref->r[dst] = muldiv_result(opcode, a, b); break;
+	case LD: ref->r[dst] = ref->dmem[b & ((SP_SRAM_HEIGHT) - 1)]; break;
+	case ST:
+		if (spro->exec1_alu1 != b)
+			ref_mismatch(sp, spro, spro, "store address", spro->exec1_alu1, b);
+		if (spro->exec1_alu0 != a)
+			ref_mismatch(sp, spro, spro, "store data", spro->exec1_alu0, a);
+		ref->dmem[b & ((SP_SRAM_HEIGHT) - 1)] = a;
+		break;
+	case SWP:
+	case CAS:
+	case FAA:
+		if (spro->exec1_alu1 != b)
+			ref_mismatch(sp, spro, spro, "atomic address", spro->exec1_alu1, b);
+		i = ref->dmem[b & ((SP_SRAM_HEIGHT) - 1)];
+		if (opcode != CAS || i == (dst == 0 ? 0 : ref->r[dst]))
+			ref->dmem[b & ((SP_SRAM_HEIGHT) - 1)] = opcode == FAA ? i + a : a;
+		ref->r[dst] = i;
+		break;
+	case JLT: is_taken = a < b; break;
+	case JLE: is_taken = a <= b; break;
+	case JEQ: is_taken = a == b; break;
+	case JNE: is_taken = a != b; break;
+	case JIN: is_taken = true; break;
+	case CPY:
+	case POL:
+	case CNT:
+		if (dst > 1)
+			ref->r[dst] = sprn->r[dst];
+		break;
+	case HLT:
+		ref->halted = 1;
+		break;
+	}
+	if (is_taken) {
+		ref->r[7] = ref->pc;
+		next_pc = (opcode == JIN ? a : imm) & LOWER_16_BITS_MASK;
+	}
+	ref->pc = next_pc;
+
+	for (i = 2; i <= 7; i++)
+		if (sprn->r[i] != ref->r[i])
+			ref_mismatch(sp, spro, sprn, "register write", sprn->r[i], ref->r[i]);
+}
+
+/* This method compares the data memory with the reference model at the end of the run */
+static void ref_check_memory(sp_t *sp) {
+	int addr;
+
+	for (addr = 0; addr < SP_SRAM_HEIGHT; addr++) {
+		if (llsim_mem_extract(sp->sramd, addr, 31, 0) != sp->ref->dmem[addr]) {
+			printf("sp: cosim mismatch at the end of the run: sramd[%d] pipeline %08x, reference %08x\n",
+				   addr, llsim_mem_extract(sp->sramd, addr, 31, 0), sp->ref->dmem[addr]);
+			exit(1);
+		}
+	}
+}
+
+/* This method completes an atomic in exec1. The old value read in exec0 goes to dst:
+   SWP writes src0, FAA writes old + src0, and CAS writes src0 only if the old value equals
+   the value of dst (the immediate for dst r1). The bus stays locked from the read on */
+static void execute_atomic(sp_t *sp, sp_registers_t *spro, sp_registers_t *sprn) {
+	int old = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+	int value = spro->exec1_alu0;
+
+	if (spro->exec1_opcode == FAA)
+		value = old + spro->exec1_alu0;
+	if (spro->exec1_opcode != CAS || old == atomic_expected(spro)) {
+		llsim_mem_set_datain(sp->sramd, value, 31, 0);
+		llsim_mem_write(sp->sramd, spro->exec1_alu1);
+		record_access(sp, ACCESS_ST, spro->exec1_alu1);
+		if (sp->dcache) { // a miss holds the pipeline behind the write
+			sp->dcache_stall = llsim_cache_access(sp->dcache, spro->exec1_alu1 & (SP_SRAM_HEIGHT - 1), 1);
+			sp->counters[CNT_DCACHE_STALL] += sp->dcache_stall;
+		}
+	}
+	if (spro->exec1_dst != 0 && spro->exec1_dst != 1)
+		sprn->r[spro->exec1_dst] = old;
+}
+
+/* This method advances the DMA engine, which runs in parallel to the pipeline */
+static void run_dma(sp_t *sp) {
+	sp_registers_t *sprn = sp->sprn;
+
+	if (!sp->is_dma_done) { // dma is not done
+		int is_mem_busy = 1;
+		if (!is_mem_operation(sprn->dec1_opcode) && !is_mem_operation(sprn->exec0_opcode) &&
+			!is_mem_operation(sprn->exec1_opcode)) {
+			is_mem_busy = 0;
+		}
+		if (is_mem_busy && sp->is_dma_active && sp->spro->dma_state == DMA_STATE_IDLE) // dma waits for the pipeline
+			sp->counters[CNT_MEM_PORT_CONFLICT]++;
+		handle_exec1_dma(sp, is_mem_busy);
+	}
+	else {
+		handle_exec1_dma(sp, 0); // dma is done, mem is not busy
+	}
+}
+
+/*
+ * fast forward. While the core spins on POL, or is halted and drains the DMA, every cycle
+ * is predictable: the state repeats with a period of a few cycles, except for the DMA
+ * position, the POL results, counters and the registers computed from them, which move
+ * by the same amount every period. Once the last three periods moved by the same amounts,
+ * the state, counters and clock are extrapolated and the DMA words of the skipped periods
+ * are copied at once. The jump stops short of the end of the DMA and of any change of a
+ * branch outcome, so the run continues exactly as without it
+ */
+
+/* This method copies the counters, bubbles and lost cycles into one array */
+static void ff_stats(sp_t *sp, unsigned int *stats, bool is_store) {
+	unsigned int *p[3] = {sp->counters, &sp->bubbles[0][0], sp->lost_cycles};
+	int n[3] = {SP_NR_COUNTERS, SP_NR_STAGES * SP_NR_BUBBLE_CAUSES, SP_NR_BUBBLE_CAUSES};
+	int i, j, k = 0;
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < n[i]; j++, k++)
+			if (is_store)
+				p[i][j] = stats[k];
+			else
+				stats[k] = p[i][j];
+}
+
+static sp_ff_frame_t *ff_frame(sp_t *sp, int cycles_ago) {
+	return &sp->ff_frames[(sp->ff_nr_frames - 1 - cycles_ago) % FF_FRAMES];
+}
+
+/* This method checks that nothing looks at every cycle */
+static bool ff_is_possible(sp_t *sp, sp_registers_t *spro) {
+	bool is_traced = (sp->cycle_trace || sp->inst_trace) && !(sp->trace_end >= 0 && spro->cycle_counter > sp->trace_end);
+
+	return sp->fast_forward && !is_traced && !sp->profile && !sp->pipeview_fp && !sp->heatmap && !sp->srami_sd &&
+		   !sp->icache && !sp->dcache && !sp->ref && !sp->max_insts && llsim_can_skip();
+}
+
+/* This method checks that the opcode keeps the values it computes linear in the DMA position */
+static bool ff_is_linear_operation(int opcode) {
+	return opcode == ADD || opcode == SUB || opcode == POL || opcode == CNT || opcode == HLT || is_branch_operation(opcode);
+}
+
+/* This method returns how many periods of the given length can be skipped, 0 if the last
+   three periods were not a steady state */
+static int ff_periods(sp_t *sp, int period) {
+	sp_ff_frame_t *f[4];
+	unsigned int *w[4], d;
+	int i, j, k, words;
+
+	for (i = 0; i < 4; i++)
+		f[i] = ff_frame(sp, i * period);
+	if (f[0]->regs.exec1_pc != f[1]->regs.exec1_pc || f[0]->regs.fetch0_pc != f[1]->regs.fetch0_pc ||
+		f[0]->regs.dma_state != f[1]->regs.dma_state)
+		return 0;
+	if (f[0]->regs.dma_state == DMA_STATE_ACTIVE || f[0]->mem_pending || f[0]->mem_accesses != f[3]->mem_accesses)
+		return 0;
+	for (i = 1; i < 4; i++)
+		if (f[i]->is_dma_done != f[0]->is_dma_done || f[i]->is_dma_active != f[0]->is_dma_active ||
+			f[i]->branch_hist_hash != f[0]->branch_hist_hash)
+			return 0;
+
+	for (i = 0; i < 4; i++)
+		w[i] = (unsigned int *) &f[i]->regs;
+	for (j = 0; j < FF_NR_WORDS; j++) {
+		d = w[0][j] - w[1][j];
+		if (d != w[1][j] - w[2][j] || d != w[2][j] - w[3][j] || (d && !sp->ff_is_linear[j]))
+			return 0;
+	}
+	for (i = 0; i < 4; i++)
+		w[i] = f[i]->stats;
+	for (j = 0; j < FF_NR_STATS; j++) {
+		d = w[0][j] - w[1][j];
+		if (d != w[1][j] - w[2][j] || d != w[2][j] - w[3][j])
+			return 0;
+	}
+	d = f[0]->inst_cnt - f[1]->inst_cnt;
+	if (d != f[1]->inst_cnt - f[2]->inst_cnt || d != f[2]->inst_cnt - f[3]->inst_cnt)
+		return 0;
+
+	// dma words per period
+	words = f[1]->regs.dma_remain - f[0]->regs.dma_remain;
+	if (words <= 0 || f[0]->regs.dma_source - f[1]->regs.dma_source != words ||
+		f[0]->regs.dma_destination - f[1]->regs.dma_destination != words)
+		return 0;
+	k = (f[0]->regs.dma_remain - 2 * words - 2) / words;
+	if (k <= 0 || f[0]->regs.dma_source + k * words > SP_SRAM_HEIGHT || f[0]->regs.dma_destination + k * words > SP_SRAM_HEIGHT)
+		return 0;
+
+	for (j = 0; j < period; j++) {
+		sp_registers_t *now = &ff_frame(sp, j)->regs, *before = &ff_frame(sp, j + period)->regs;
+		long long x, dx;
+
+		if ((now->exec0_active && !ff_is_linear_operation(now->exec0_opcode)) ||
+			(now->exec1_active && !ff_is_linear_operation(now->exec1_opcode)))
+			return 0;
+		if (!now->exec1_active || !is_branch_operation(now->exec1_opcode))
+			continue;
+		// the branch outcome holds while its operands keep their order
+		x = (long long) now->exec1_alu0 - now->exec1_alu1;
+		dx = ((long long) now->exec1_alu0 - before->exec1_alu0) - ((long long) now->exec1_alu1 - before->exec1_alu1);
+		if (dx == 0 || (x > 0 && dx > 0) || (x < 0 && dx < 0))
+			continue;
+		if (x == 0)
+			return 0;
+		if ((llabs(x) - 1) / llabs(dx) < k)
+			k = (llabs(x) - 1) / llabs(dx);
+	}
+	return k;
+}
+
+/* This method moves the state forward by the given number of periods */
+static void ff_jump(sp_t *sp, int period, int periods) {
+	sp_ff_frame_t *f0 = ff_frame(sp, 0), *f1 = ff_frame(sp, period);
+	unsigned int *now = (unsigned int *) sp->spro;
+	unsigned int stats[FF_NR_STATS];
+	int *data = sp->sramd->data;
+	int j, words;
+
+	words = periods * (f1->regs.dma_remain - f0->regs.dma_remain);
+	for (j = 0; j < words; j++) // word by word, as the dma engine
+		data[sp->spro->dma_destination + j] = data[sp->spro->dma_source + j];
+
+	for (j = 0; j < FF_NR_WORDS; j++)
+		now[j] += periods * (((unsigned int *) &f0->regs)[j] - ((unsigned int *) &f1->regs)[j]);
+	memcpy(sp->sprn, sp->spro, sizeof(sp_registers_t));
+	for (j = 0; j < FF_NR_STATS; j++)
+		stats[j] = f0->stats[j] + periods * (f0->stats[j] - f1->stats[j]);
+	ff_stats(sp, stats, true);
+	sp->inst_cnt += periods * (f0->inst_cnt - f1->inst_cnt);
+
+	llsim_skip_clocks(periods * period);
+	sp->ff_skipped += (long long) periods * period;
+	sp->ff_nr_frames = 0;
+}
+
+/* This method records the state of the cycle and skips ahead once it is in a steady state */
+static void ff_cycle(sp_t *sp, sp_registers_t *spro) {
+	sp_ff_frame_t *f;
+	int period, periods, i;
+
+	if (!ff_is_possible(sp, spro)) {
+		sp->ff_nr_frames = 0;
+		return;
+	}
+	if (is_mem_operation(spro->dec1_opcode) || is_mem_operation(spro->exec0_opcode) || is_mem_operation(spro->exec1_opcode))
+		sp->ff_mem_accesses++;
+
+	f = &sp->ff_frames[sp->ff_nr_frames % FF_FRAMES];
+	sp->ff_nr_frames++;
+	f->regs = *spro;
+	ff_stats(sp, f->stats, false);
+	f->inst_cnt = sp->inst_cnt;
+	f->is_dma_done = sp->is_dma_done;
+	f->is_dma_active = sp->is_dma_active;
+	f->mem_accesses = sp->ff_mem_accesses;
+	f->mem_pending = sp->sramd->pending;
+	f->branch_hist_hash = 0;
+	for (i = 0; i < branch_hist_SIZE; i++)
+		f->branch_hist_hash = f->branch_hist_hash * 31 + sp->branch_hist[i];
+
+	if (spro->dma_remain <= 0)
+		return;
+	for (period = 1; period <= FF_MAX_PERIOD && 3 * period < sp->ff_nr_frames; period++) {
+		periods = ff_periods(sp, period);
+		if (periods >= 2) {
+			ff_jump(sp, period, periods);
+			return;
+		}
 	}
 }
 
@@ -677,54 +2003,11 @@ static void sp_ctl(sp_t *sp)
 	sp_registers_t *sprn = sp->sprn;
 	int i;
 
-	fprintf(cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
-	fprintf(cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
-	for (i = 2; i <= 7; i++)
-		fprintf(cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
-
-	fprintf(cycle_trace_fp, "fetch0_active %08x\n", spro->fetch0_active);
-	fprintf(cycle_trace_fp, "fetch0_pc %08x\n", spro->fetch0_pc);
-
-	fprintf(cycle_trace_fp, "fetch1_active %08x\n", spro->fetch1_active);
-	fprintf(cycle_trace_fp, "fetch1_pc %08x\n", spro->fetch1_pc);
-
-	fprintf(cycle_trace_fp, "dec0_active %08x\n", spro->dec0_active);
-	fprintf(cycle_trace_fp, "dec0_pc %08x\n", spro->dec0_pc);
-	fprintf(cycle_trace_fp, "dec0_inst %08x\n", spro->dec0_inst); // 32 bits
-
-	fprintf(cycle_trace_fp, "dec1_active %08x\n", spro->dec1_active);
-	fprintf(cycle_trace_fp, "dec1_pc %08x\n", spro->dec1_pc);				// 16 bits
-	fprintf(cycle_trace_fp, "dec1_inst %08x\n", spro->dec1_inst);			// 32 bits
-	fprintf(cycle_trace_fp, "dec1_opcode %08x\n", spro->dec1_opcode);		// 5 bits
-	fprintf(cycle_trace_fp, "dec1_src0 %08x\n", spro->dec1_src0);			// 3 bits
-	fprintf(cycle_trace_fp, "dec1_src1 %08x\n", spro->dec1_src1);			// 3 bits
-	fprintf(cycle_trace_fp, "dec1_dst %08x\n", spro->dec1_dst);				// 3 bits
-	fprintf(cycle_trace_fp, "dec1_immediate %08x\n", spro->dec1_immediate); // 32 bits
-
-	fprintf(cycle_trace_fp, "exec0_active %08x\n", spro->exec0_active);
-	fprintf(cycle_trace_fp, "exec0_pc %08x\n", spro->exec0_pc);				  // 16 bits
-	fprintf(cycle_trace_fp, "exec0_inst %08x\n", spro->exec0_inst);			  // 32 bits
-	fprintf(cycle_trace_fp, "exec0_opcode %08x\n", spro->exec0_opcode);		  // 5 bits
-	fprintf(cycle_trace_fp, "exec0_src0 %08x\n", spro->exec0_src0);			  // 3 bits
-	fprintf(cycle_trace_fp, "exec0_src1 %08x\n", spro->exec0_src1);			  // 3 bits
-	fprintf(cycle_trace_fp, "exec0_dst %08x\n", spro->exec0_dst);			  // 3 bits
-	fprintf(cycle_trace_fp, "exec0_immediate %08x\n", spro->exec0_immediate); // 32 bits
-	fprintf(cycle_trace_fp, "exec0_alu0 %08x\n", spro->exec0_alu0);			  // 32 bits
-	fprintf(cycle_trace_fp, "exec0_alu1 %08x\n", spro->exec0_alu1);			  // 32 bits
-
-	fprintf(cycle_trace_fp, "exec1_active %08x\n", spro->exec1_active);
-	fprintf(cycle_trace_fp, "exec1_pc %08x\n", spro->exec1_pc);				  // 16 bits
-	fprintf(cycle_trace_fp, "exec1_inst %08x\n", spro->exec1_inst);			  // 32 bits
-	fprintf(cycle_trace_fp, "exec1_opcode %08x\n", spro->exec1_opcode);		  // 5 bits
-	fprintf(cycle_trace_fp, "exec1_src0 %08x\n", spro->exec1_src0);			  // 3 bits
-	fprintf(cycle_trace_fp, "exec1_src1 %08x\n", spro->exec1_src1);			  // 3 bits
-	fprintf(cycle_trace_fp, "exec1_dst %08x\n", spro->exec1_dst);			  // 3 bits
-	fprintf(cycle_trace_fp, "exec1_immediate %08x\n", spro->exec1_immediate); // 32 bits
-	fprintf(cycle_trace_fp, "exec1_alu0 %08x\n", spro->exec1_alu0);			  // 32 bits
-	fprintf(cycle_trace_fp, "exec1_alu1 %08x\n", spro->exec1_alu1);			  // 32 bits
-	fprintf(cycle_trace_fp, "exec1_aluout %08x\n", spro->exec1_aluout);
-
-	fprintf(cycle_trace_fp, "\n\n\n"); // changes were made to align with example outputs
+	update_trace_window(sp, spro);
+	if (sp->cycle_trace_on)
+		trace_cycle_to_file(sp, spro);
+	if (sp->fast_forward)
+		ff_cycle(sp, spro);
 
 	sp_printf("cycle_counter %08x\n", spro->cycle_counter);
 	sp_printf("r2 %08x, r3 %08x\n", spro->r[2], spro->r[3]);
@@ -735,16 +2018,58 @@ static void sp_ctl(sp_t *sp)
 			  spro->fetch0_pc, spro->fetch1_pc, spro->dec0_pc, spro->dec1_pc, spro->exec0_pc, spro->exec1_pc);
 
 	sprn->cycle_counter = spro->cycle_counter + 1;
+	sprn->mbox_push = sprn->mbox_pop = 0;
+	count_cycle(sp, spro);
+	sp->is_bus_granted = !sp_bus || sp_bus_winner() == sp->id;
+	if (!sp->is_bus_granted && sp_bus_request(spro))
+		sp->counters[CNT_BUS_WAIT]++;
+
+	int stall_counter = CNT_SRAMD_STALL;
+	bool is_muldiv_wait = is_muldiv_busy(sp, spro, sprn);
+	bool is_load_use_stall = is_load_use_stall_needed(sp, spro);
+	bool is_store_miss_stall = is_dcache_store_stall(sp); // counts down during the other stalls too
+	bool is_stalled = is_load_use_stall || is_store_miss_stall;
+	if (!is_stalled && sp_mbox && is_mbox_wait_needed(sp, spro)) {
+		is_stalled = true;
+		stall_counter = CNT_MBOX_WAIT;
+	}
+	if (!is_stalled && is_muldiv_wait) {
+		is_stalled = true;
+		stall_counter = CNT_MULDIV_BUSY;
+	}
+	int squash_cause[SP_NR_STAGES] = {-1, -1, -1, -1, -1, -1};
+	if (sp->profile)
+		profile_cycle(sp, spro, is_stalled);
+	count_bubbles(sp, spro, is_stalled);
+	if (sp->pipeview_fp)
+		pipeview_cycle(sp, spro);
+
+	bool was_dma_done = sp->is_dma_done;
+	bool is_held[SP_NR_STAGES] = {false, false, false, false, false, false};
+
+	if (is_stalled) { // waiting for SRAMD, the mailbox or the multiply and divide unit, all stages keep their values
+		sp->counters[stall_counter]++;
+		if (spro->fetch1_active) // keep the fetched instruction on the SRAMI output
+			llsim_mem_read(sp->srami, spro->fetch1_pc);
+		run_dma(sp);
+		return;
+	}
 
 	if (sp->start)
 		sprn->fetch0_active = 1;
 
 	// fetch0
 	sprn->fetch1_active = 0;
-	if (spro->fetch0_active) { // reading current instruction from memory
-		if (!is_dma_done)
+	if (spro->fetch0_active && !sp->is_dma_done && is_icache_miss(sp, spro->fetch0_pc)) { // waiting for the line fill
+		sp->counters[CNT_ICACHE_STALL]++;
+		squash_cause[STAGE_FETCH1] = BUBBLE_ICACHE_MISS;
+		is_held[STAGE_FETCH0] = true;
+	}
+	else if (spro->fetch0_active) { // reading current instruction from memory
+		if (!sp->is_dma_done)
 		{
 			llsim_mem_read(sp->srami, spro->fetch0_pc);					  // fetching the current instruction from SRAMI
+			record_access(sp, ACCESS_FETCH, spro->fetch0_pc);
 			sprn->fetch0_pc = (spro->fetch0_pc + 1) & LOWER_16_BITS_MASK; // updating to next pc
 			sprn->fetch1_pc = spro->fetch0_pc;							  // moving pc value in pipeline
 		}
@@ -753,7 +2078,7 @@ static void sp_ctl(sp_t *sp)
 
 	// fetch1
 	if (spro->fetch1_active) { // sampling memoty output to the instruction register
-		if (!is_dma_done)
+		if (!sp->is_dma_done)
 		{
 			sprn->dec0_pc = spro->fetch1_pc; // setting pc for next stage
 			sprn->dec0_inst = llsim_mem_extract_dataout(sp->srami, 31, 0);
@@ -766,14 +2091,22 @@ static void sp_ctl(sp_t *sp)
 
 	// dec0
 	if (spro->dec0_active) { // decoding instruction
-		if (!is_dma_done) {
+		if (!sp->is_dma_done) {
 			int opcode = (spro->dec0_inst & OPCODE_MASK) >> OPCODE_SHIFT;
 			if (opcode == JLT || opcode == JLE || opcode == JEQ || opcode == JNE) { // branch prediction
-				handle_branch_prediction(spro, sprn);
+				if (handle_branch_prediction(sp, spro, sprn)) {
+					sp->counters[CNT_FLUSH]++;
+					squash_cause[STAGE_FETCH1] = squash_cause[STAGE_DEC0] = BUBBLE_REDIRECT;
+				}
 			}
 
-			if (opcode == LD && spro->dec1_opcode == ST && spro->dec1_active) { // load after store, RAW hazard
+			if (is_mem_read_operation(opcode) && is_mem_write_operation(spro->dec1_opcode) && spro->dec1_active) { // load after store, RAW hazard
 				handle_load_after_store(spro, sprn);
+				sp->counters[CNT_LD_AFTER_ST_STALL]++;
+				squash_cause[STAGE_FETCH1] = squash_cause[STAGE_DEC1] = BUBBLE_LD_AFTER_ST;
+				is_held[STAGE_DEC0] = true;
+				if (spro->fetch1_active)
+					is_held[STAGE_FETCH0] = false;
 			}
 			else {
 				sprn->dec1_opcode = (spro->dec0_inst & OPCODE_MASK) >> OPCODE_SHIFT;
@@ -800,7 +2133,7 @@ static void sp_ctl(sp_t *sp)
 
 	// dec1
 	if (spro->dec1_active) { // preparing ALU operands
-		if (!is_dma_done) {
+		if (!sp->is_dma_done) {
 			decide_exec0_alu0_value(sp, spro, sprn);
 			decide_exec0_alu1_value(sp, spro, sprn);
 
@@ -834,6 +2167,7 @@ static void sp_ctl(sp_t *sp)
 			sprn->exec1_aluout = aluout;
 		}
 		handle_exec0_dma(sprn, spro);
+		sprn->muldiv_cycles = 0; // a MUL/DIV leaves the unit
 		// moving instruction values in pipeline
 		sprn->exec1_pc = spro->exec0_pc;
 		sprn->exec1_inst = spro->exec0_inst;
@@ -853,28 +2187,43 @@ static void sp_ctl(sp_t *sp)
 
 	// exec1
 	if (spro->exec1_active) { // writing back
+		llsim_assert(!sp->max_insts || sp->inst_cnt < sp->max_insts, "sp: instruction budget of %d exhausted at pc %04x\n",
+					 sp->max_insts, spro->exec1_pc);
 		trace_inst_to_file(sp, spro, sprn);
 
-		inst_cnt = inst_cnt + 1;
+		sp->inst_cnt = sp->inst_cnt + 1;
+		sp->counters[CNT_RETIRED]++;
+		if (sp->profile)
+			sp->profile[spro->exec1_pc].count++;
 
 		// dma
-		if (spro->exec1_opcode == HLT || is_dma_done) { // end of execution or dma is done
+		if (spro->exec1_opcode == HLT || sp->is_dma_done) { // end of execution or dma is done
 			if (spro->dma_remain > 0) { 
-				is_dma_done = true;
+				sp->is_dma_done = true;
 			}
 			else {
-				is_dma_done = false;
-				llsim_stop();
-				fprintf(inst_trace_fp, "sim finished at pc %i, %i instructions", spro->exec1_pc, inst_cnt);
-				dump_sram(sp, "srami_out.txt", sp->srami);
-				dump_sram(sp, "sramd_out.txt", sp->sramd);
+				sp->is_dma_done = false;
+				if (sp->ref)
+					ref_check_memory(sp);
+				fprintf(sp->inst_trace_fp, "sim finished at pc %i, %i instructions", spro->exec1_pc, sp->inst_cnt);
+				dump_sram(sp, sp_file_name(sp, "srami_out.txt"), sp->srami);
 				sp->start = 0;
+				halt_core(sp, sprn);
 			}
 		}
 
 		else if (spro->exec1_opcode == ST) { // executing ST
 			llsim_mem_set_datain(sp->sramd, spro->exec1_alu0, 31, 0);
 			llsim_mem_write(sp->sramd, spro->exec1_alu1);
+			record_access(sp, ACCESS_ST, spro->exec1_alu1);
+			if (sp->dcache) { // a miss holds the pipeline behind the store
+				sp->dcache_stall = llsim_cache_access(sp->dcache, spro->exec1_alu1 & (SP_SRAM_HEIGHT - 1), 1);
+				sp->counters[CNT_DCACHE_STALL] += sp->dcache_stall;
+			}
+		}
+
+		else if (is_atomic_operation(spro->exec1_opcode)) { // the read half was done in exec0
+			execute_atomic(sp, spro, sprn);
 		}
 
 		else if (spro->exec1_opcode == LD) { // executing LD
@@ -882,6 +2231,20 @@ static void sp_ctl(sp_t *sp)
 				sprn->r[spro->exec1_dst] = llsim_mem_extract_dataout(sp->sramd, 31, 0);
 		}
 
+		else if (spro->exec1_opcode == SND || spro->exec1_opcode == RCV) { // the mailbox has room or data
+			llsim_assert(sp_mbox, "sp: %s at pc %04x needs cores > 1\n", opcode_name[spro->exec1_opcode], spro->exec1_pc);
+			if (spro->exec1_opcode == SND) {
+				sprn->mbox_push = 1;
+				sprn->mbox_push_core = spro->exec1_alu1;
+				sprn->mbox_push_data = spro->exec1_alu0;
+			}
+			else {
+				if (spro->exec1_dst != 0 && spro->exec1_dst != 1)
+					sprn->r[spro->exec1_dst] = sp_mbox_head(sp->id);
+				sprn->mbox_pop = 1;
+			}
+		}
+
 		else if (is_branch_operation(spro->exec1_opcode)) { // checks if branch is taken and updates the next pc
 			bool is_branch_taken = false;
 			int next_pc;
@@ -901,10 +2264,15 @@ static void sp_ctl(sp_t *sp)
 			}
 
             // Updating the branch history according to the prediciton state machine
-			update_branch_history(spro, sprn, is_branch_taken);
+			update_branch_history(sp, spro, sprn, is_branch_taken);
+			sp->counters[is_branch_taken ? CNT_BRANCH_TAKEN : CNT_BRANCH_NOT_TAKEN]++;
 
 			bool is_flush_needed = check_if_flush_is_needed(spro, next_pc);
 			if (is_flush_needed) { // flushing
+				sp->counters[CNT_MISPREDICT]++;
+				sp->counters[CNT_FLUSH]++;
+				if (sp->profile)
+					sp->profile[spro->exec1_pc].mispredicts++;
 				sprn->fetch0_active = 1;
 				sprn->dec0_active = 0;
 				sprn->exec0_active = 0;
@@ -912,30 +2280,27 @@ static void sp_ctl(sp_t *sp)
 				sprn->dec1_active = 0;
 				sprn->exec1_active = 0;
 				sprn->fetch0_pc = next_pc;
+				for (i = STAGE_FETCH1; i < SP_NR_STAGES; i++)
+					squash_cause[i] = BUBBLE_FLUSH;
 			}
 		}
 
 		else if (spro->exec1_dst != 0 && spro->exec1_dst != 1) { // WB to register
 			sprn->r[spro->exec1_dst] = spro->exec1_aluout;
 		}
+
+		if (sp->ref)
+			ref_retire(sp, spro, sprn);
 	}
 
 	if (spro->exec1_opcode == CPY) {
-		is_dma_active = true;
+		sp->is_dma_active = true;
 	}
 
-	if (!is_dma_done) { // dma is not done
-		int is_mem_busy = 1;
-		if (sprn->dec1_opcode != LD && sprn->dec1_opcode != ST &&
-			sprn->exec0_opcode != LD && sprn->exec0_opcode != ST &&
-			sprn->exec1_opcode != LD && sprn->exec1_opcode != ST) {
-			is_mem_busy = 0;
-		}
-		handle_exec1_dma(sp, is_mem_busy);
-	}
-	else {
-		handle_exec1_dma(sp, 0); // dma is done, mem is not busy
-	}
+	classify_bubbles(spro, sprn, squash_cause);
+	if (sp->pipeview_fp && !was_dma_done) // the pipeline is frozen while draining the dma
+		track_seq(sp, spro, sprn, is_held);
+	run_dma(sp);
 }
 
 static void sp_run(llsim_unit_t *unit)
@@ -949,6 +2314,7 @@ static void sp_run(llsim_unit_t *unit)
 	if (llsim->reset)
 	{
 		sp_reset(sp);
+		llsim_idle_until(unit, LLSIM_IDLE_FOREVER);
 		return;
 	}
 
@@ -958,9 +2324,127 @@ static void sp_run(llsim_unit_t *unit)
 	sp->sramd->write = 0;
 
 	sp_ctl(sp);
+	if (sp->is_halted)
+		llsim_idle_until(unit, LLSIM_IDLE_FOREVER);
 }
 
-static void sp_generate_sram_memory_image(sp_t *sp, char *program_name)
+static void dump_stack_distance(sp_t *sp, char *hist_name, char *sweep_name)
+{
+	FILE *hist_fp, *sweep_fp;
+
+	hist_fp = fopen(hist_name, "w");
+	sweep_fp = fopen(sweep_name, "w");
+	if (hist_fp == NULL || sweep_fp == NULL)
+	{
+		printf("couldn't open file %s\n", hist_fp == NULL ? hist_name : sweep_name);
+		exit(1);
+	}
+	fprintf(sweep_fp, "# mem size line sets assoc hits accesses hit_rate\n");
+	llsim_stackdist_dump(sp->srami_sd, hist_fp, sweep_fp);
+	llsim_stackdist_dump(sp->sramd_sd, hist_fp, sweep_fp);
+	fclose(hist_fp);
+	fclose(sweep_fp);
+}
+
+static void sp_finish(llsim_unit_t *unit)
+{
+	sp_t *sp = (sp_t *)unit->private;
+
+	dump_counters(sp, sp_file_name(sp, "perf_counters.txt"));
+	if (sp->profile)
+		dump_profile(sp, sp_file_name(sp, "profile.txt"), sp_file_name(sp, "profile.folded"));
+	if (llsim_get_param("bubbles", 0))
+		dump_bubbles(sp, sp_file_name(sp, "bubbles.txt"));
+	if (sp->pipeview_fp)
+		pipeview_finish(sp);
+	if (sp->srami_sd)
+		dump_stack_distance(sp, sp_file_name(sp, "stack_distance.txt"), sp_file_name(sp, "cache_sweep.txt"));
+	if (sp->heatmap)
+		dump_heatmap(sp, sp_file_name(sp, "heatmap.bin"), sp_file_name(sp, "heatmap.txt"));
+	if (sp->ff_skipped)
+		llsim_printf("sp: fast forward skipped %lld of %d clocks\n", sp->ff_skipped, llsim->clock);
+}
+
+/*
+ * registers every hardware field of sp_registers_t with its width, for the generic
+ * llsim tracing. The cycle_trace.txt fields come first, in file order. The simulation
+ * only fields (bubble causes, sequence numbers) are left out
+ */
+#define sp_register_field(sp, field, bits) \
+	llsim_register_register((sp)->name, #field, bits, 0, &(sp)->spro->field, &(sp)->sprn->field)
+
+static void sp_register_registers(sp_t *sp)
+{
+	llsim_register_t *reg;
+	char name[8];
+	int i;
+
+	sp_register_field(sp, cycle_counter, 32);
+	for (i = 2; i <= 7; i++) {
+		sprintf(name, "r%d", i);
+		llsim_register_register(sp->name, name, 32, 0, &sp->spro->r[i], &sp->sprn->r[i]);
+	}
+
+	sp_register_field(sp, fetch0_active, 1);
+	sp_register_field(sp, fetch0_pc, 16);
+
+	sp_register_field(sp, fetch1_active, 1);
+	sp_register_field(sp, fetch1_pc, 16);
+
+	sp_register_field(sp, dec0_active, 1);
+	sp_register_field(sp, dec0_pc, 16);
+	sp_register_field(sp, dec0_inst, 32);
+
+	sp_register_field(sp, dec1_active, 1);
+	sp_register_field(sp, dec1_pc, 16);
+	sp_register_field(sp, dec1_inst, 32);
+	sp_register_field(sp, dec1_opcode, 5);
+	sp_register_field(sp, dec1_src0, 3);
+	sp_register_field(sp, dec1_src1, 3);
+	sp_register_field(sp, dec1_dst, 3);
+	sp_register_field(sp, dec1_immediate, 32);
+
+	sp_register_field(sp, exec0_active, 1);
+	sp_register_field(sp, exec0_pc, 16);
+	sp_register_field(sp, exec0_inst, 32);
+	sp_register_field(sp, exec0_opcode, 5);
+	sp_register_field(sp, exec0_src0, 3);
+	sp_register_field(sp, exec0_src1, 3);
+	sp_register_field(sp, exec0_dst, 3);
+	sp_register_field(sp, exec0_immediate, 32);
+	sp_register_field(sp, exec0_alu0, 32);
+	sp_register_field(sp, exec0_alu1, 32);
+
+	sp_register_field(sp, exec1_active, 1);
+	sp_register_field(sp, exec1_pc, 16);
+	sp_register_field(sp, exec1_inst, 32);
+	sp_register_field(sp, exec1_opcode, 5);
+	sp_register_field(sp, exec1_src0, 3);
+	sp_register_field(sp, exec1_src1, 3);
+	sp_register_field(sp, exec1_dst, 3);
+	sp_register_field(sp, exec1_immediate, 32);
+	sp_register_field(sp, exec1_alu0, 32);
+	sp_register_field(sp, exec1_alu1, 32);
+	sp_register_field(sp, exec1_aluout, 32);
+	for (reg = llsim_find_unit(sp->name)->registers; reg; reg = reg->next)
+		sp->nr_trace_registers++;
+
+	sp_register_field(sp, dma_source, 32);
+	sp_register_field(sp, dma_destination, 32);
+	sp_register_field(sp, dma_length, 32);
+	sp_register_field(sp, dma_state, 2);
+	sp_register_field(sp, dma_remain, 32);
+	sp_register_field(sp, is_dma_busy, 1);
+
+	sp_register_field(sp, mbox_push, 1);
+	sp_register_field(sp, mbox_push_core, 6);
+	sp_register_field(sp, mbox_push_data, 32);
+	sp_register_field(sp, mbox_pop, 1);
+
+	sp_register_field(sp, muldiv_cycles, 8);
+}
+
+static void sp_generate_sram_memory_image(sp_t *sp, char *program_name, bool is_sramd_owner)
 {
 	FILE *fp;
 	int addr, i;
@@ -982,49 +2466,210 @@ static void sp_generate_sram_memory_image(sp_t *sp, char *program_name)
 	}
 	sp->memory_image_size = addr;
 
-	fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, addr);
+	sp->inst_trace_bytes += fprintf(sp->inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, addr);
 
 	for (i = 0; i < sp->memory_image_size; i++)
 	{
 		llsim_mem_inject(sp->srami, i, sp->memory_image[i], 31, 0);
-		llsim_mem_inject(sp->sramd, i, sp->memory_image[i], 31, 0);
+		if (is_sramd_owner)
+			llsim_mem_inject(sp->sramd, i, sp->memory_image[i], 31, 0);
 	}
 }
 
-void sp_init(char *program_name)
+/* This method creates a core: its unit, registers, trace files, SRAMI and SRAMD.
+   With several cores the SRAMD of core 0 is shared, the other cores get a port on it */
+static sp_t *sp_create_core(int id, char *name, char *program_name)
 {
 	llsim_unit_t *llsim_sp_unit;
 	llsim_unit_registers_t *llsim_ur;
+	llsim_register_t *reg;
 	sp_t *sp;
+	int i;
 
-	llsim_printf("initializing sp unit\n");
+	llsim_sp_unit = llsim_register_unit(name, sp_run);
+	llsim_sp_unit->finish = sp_finish;
+	llsim_ur = llsim_allocate_registers(llsim_sp_unit, "sp_registers", sizeof(sp_registers_t));
+	sp = llsim_malloc(sizeof(sp_t));
+	llsim_sp_unit->private = sp;
+	sp->name = llsim_sp_unit->name;
+	sp->id = id;
+	sp->spro = llsim_ur->old;
+	sp->sprn = llsim_ur->new;
+	sp_register_registers(sp);
 
-	inst_trace_fp = fopen("inst_trace.txt", "w");
-	if (inst_trace_fp == NULL)
+	sp->inst_trace_fp = fopen(sp_file_name(sp, "inst_trace.txt"), "w");
+	if (sp->inst_trace_fp == NULL)
 	{
-		printf("couldn't open file inst_trace.txt\n");
+		printf("couldn't open file %s\n", sp_file_name(sp, "inst_trace.txt"));
 		exit(1);
 	}
 
-	cycle_trace_fp = fopen("cycle_trace.txt", "w");
-	if (cycle_trace_fp == NULL)
+	sp->cycle_trace_fp = fopen(sp_file_name(sp, "cycle_trace.txt"), "w");
+	if (sp->cycle_trace_fp == NULL)
 	{
-		printf("couldn't open file cycle_trace.txt\n");
+		printf("couldn't open file %s\n", sp_file_name(sp, "cycle_trace.txt"));
 		exit(1);
 	}
 
-	llsim_sp_unit = llsim_register_unit("sp", sp_run);
-	llsim_ur = llsim_allocate_registers(llsim_sp_unit, "sp_registers", sizeof(sp_registers_t));
-	sp = llsim_malloc(sizeof(sp_t));
-	llsim_sp_unit->private = sp;
-	sp->spro = llsim_ur->old;
-	sp->sprn = llsim_ur->new;
-
 	sp->srami = llsim_allocate_memory(llsim_sp_unit, "srami", 32, SP_SRAM_HEIGHT, 0);
-	sp->sramd = llsim_allocate_memory(llsim_sp_unit, "sramd", 32, SP_SRAM_HEIGHT, 0);
-	sp_generate_sram_memory_image(sp, program_name);
+	if (id == 0)
+		sp->sramd = llsim_allocate_memory(llsim_sp_unit, "sramd", 32, SP_SRAM_HEIGHT, 0);
+	else
+		sp->sramd = llsim_allocate_memory_port(llsim_sp_unit, sp_bus->cores[0]->sramd);
+	sp->sramd->latency = llsim_get_param("sramd_latency", 1);
+	llsim_assert(sp->sramd->latency >= 1, "ERROR: sramd_latency must be at least 1\n");
+	sp_generate_sram_memory_image(sp, program_name, id == 0);
+	sp->program_name = program_name;
+
+	if (llsim_get_param("icache_size", 0))
+		sp->icache = llsim_cache_create("icache", llsim_get_param("icache_size", 0), llsim_get_param("icache_assoc", 1),
+										llsim_get_param("icache_line", 4), llsim_get_param("icache_miss_latency", 10),
+										llsim_get_param_str("icache_policy", "lru"), 0, 0);
+	if (llsim_get_param("dcache_size", 0))
+		sp->dcache = llsim_cache_create("dcache", llsim_get_param("dcache_size", 0), llsim_get_param("dcache_assoc", 1),
+										llsim_get_param("dcache_line", 4), llsim_get_param("dcache_miss_latency", 10),
+										llsim_get_param_str("dcache_policy", "lru"), llsim_get_param("dcache_write_back", 1),
+										llsim_get_param("dcache_write_allocate", 1));
+
+	if (llsim_get_param("stack_distance", 0)) {
+		sp->srami_sd = llsim_stackdist_create("srami", llsim_get_param("sd_max_line", 16), llsim_get_param("sd_max_sets", 1024),
+											  llsim_get_param("sd_max_assoc", 16));
+		sp->sramd_sd = llsim_stackdist_create("sramd", llsim_get_param("sd_max_line", 16), llsim_get_param("sd_max_sets", 1024),
+											  llsim_get_param("sd_max_assoc", 16));
+	}
+
+	if (llsim_get_param("heatmap", 0)) {
+		sp->heatmap = llsim_malloc(sizeof(sp_heatmap_t));
+		sp->heatmap->reads = llsim_malloc(SP_SRAM_HEIGHT * sizeof(unsigned int));
+		sp->heatmap->writes = llsim_malloc(SP_SRAM_HEIGHT * sizeof(unsigned int));
+		sp->heatmap->fetches = llsim_malloc(SP_SRAM_HEIGHT * sizeof(unsigned int));
+		sp->heatmap->block_size = llsim_get_param("heatmap_block", 64);
+		llsim_assert(sp->heatmap->block_size > 0 && (SP_SRAM_HEIGHT) % sp->heatmap->block_size == 0,
+					 "ERROR: heatmap_block must divide the sram height\n");
+	}
+
+	if (llsim_get_param("pipeview", 0)) {
+		sp->pipeview_fp = fopen(sp_file_name(sp, "pipeview.kanata"), "w");
+		if (sp->pipeview_fp == NULL)
+		{
+			printf("couldn't open file %s\n", sp_file_name(sp, "pipeview.kanata"));
+			exit(1);
+		}
+		fprintf(sp->pipeview_fp, "Kanata\t0004\nC=\t0\n");
+		sp->pv_last_seq = -1;
+	}
+
+	if (llsim_get_param("profile", 0))
+		sp->profile = llsim_malloc(SP_SRAM_HEIGHT * sizeof(sp_profile_entry_t));
+
+	sp->max_insts = llsim_get_param("max_insts", 0);
+	sp->mul_latency = llsim_get_param("mul_latency", 3);
+	sp->div_latency = llsim_get_param("div_latency", 12);
+	llsim_assert(sp->mul_latency >= 1 && sp->mul_latency <= 255 && sp->div_latency >= 1 && sp->div_latency <= 255,
+				 "ERROR: mul_latency and div_latency must be 1 to 255\n");
+
+	sp->fast_forward = llsim_get_param("fast_forward", 0);
+	if (sp->fast_forward) {
+		int linear[] = {offsetof(sp_registers_t, cycle_counter), offsetof(sp_registers_t, exec0_alu0),
+						offsetof(sp_registers_t, exec0_alu1), offsetof(sp_registers_t, exec1_alu0),
+						offsetof(sp_registers_t, exec1_alu1), offsetof(sp_registers_t, exec1_aluout),
+						offsetof(sp_registers_t, dma_source), offsetof(sp_registers_t, dma_destination),
+						offsetof(sp_registers_t, dma_remain)};
+
+		sp->ff_frames = llsim_malloc(FF_FRAMES * sizeof(sp_ff_frame_t));
+		for (i = 0; i < 8; i++)
+			sp->ff_is_linear[offsetof(sp_registers_t, r[i]) / sizeof(int)] = 1;
+		for (i = 0; i < sizeof(linear) / sizeof(linear[0]); i++)
+			sp->ff_is_linear[linear[i] / sizeof(int)] = 1;
+	}
+
+	if (llsim_get_param("cosim", 0)) {
+		sp->ref = llsim_malloc(sizeof(sp_ref_t));
+		sp->ref->imem = llsim_malloc(SP_SRAM_HEIGHT * sizeof(unsigned int));
+		sp->ref->dmem = llsim_malloc(SP_SRAM_HEIGHT * sizeof(unsigned int));
+		memcpy(sp->ref->imem, sp->memory_image, SP_SRAM_HEIGHT * sizeof(unsigned int));
+		memcpy(sp->ref->dmem, sp->memory_image, SP_SRAM_HEIGHT * sizeof(unsigned int));
+	}
+
+	sp->cycle_trace = llsim_get_param("cycle_trace", 1);
+	sp->inst_trace = llsim_get_param("inst_trace", 1);
+	sp->trace_start = llsim_get_param("trace_start", 0);
+	sp->trace_end = llsim_get_param("trace_end", -1);
+	sp->trace_pc_lo = llsim_get_param("trace_pc_lo", 0);
+	sp->trace_pc_hi = llsim_get_param("trace_pc_hi", -1);
+	sp->trace_after_cpy = llsim_get_param("trace_after_cpy", 0);
+	sp->trace_st_addr = llsim_get_param("trace_after_st", -1);
+	sp->trace_triggered = !sp->trace_after_cpy && sp->trace_st_addr < 0;
+	sp->cycle_trace_regs = llsim_malloc(sp->nr_trace_registers * sizeof(llsim_register_t *));
+	reg = llsim_sp_unit->registers;
+	for (i = 0; i < sp->nr_trace_registers; i++, reg = reg->next)
+		if (llsim_name_matches(llsim_get_param_str("trace_fields", "*"), sp->name, reg->reg_name))
+			sp->cycle_trace_regs[sp->nr_cycle_trace_regs++] = reg;
+	if (llsim_get_param("trace_index", 0)) {
+		sp->cycle_index_fp = open_trace_index(sp_file_name(sp, "cycle_trace.idx"));
+		sp->inst_index_fp = open_trace_index(sp_file_name(sp, "inst_trace.idx"));
+	}
 
 	sp->start = 1;
+	return sp;
+}
+
+void sp_init(char *program_name)
+{
+	llsim_unit_t *bus_unit, *mbox_unit;
+	llsim_unit_registers_t *bus_regs, *mbox_regs;
+	char name[32], param[16], *policy;
+	int nr_cores, i, j;
+
+	llsim_printf("initializing sp unit\n");
+
+	nr_cores = llsim_get_param("cores", 1);
+	llsim_assert(nr_cores >= 1 && nr_cores <= SP_MAX_CORES, "ERROR: cores must be 1 to %d\n", SP_MAX_CORES);
+	if (nr_cores == 1) {
+		sp_create_core(0, "sp", program_name);
+		return;
+	}
+	llsim_assert(!llsim_get_param("cosim", 0) && !llsim_get_param("dcache_size", 0),
+				 "ERROR: cosim and dcache_size need a single core, the other cores write the shared SRAMD\n");
+
+	sp_bus = llsim_malloc(sizeof(sp_bus_t));
+	sp_bus->nr_cores = nr_cores;
+	sp_bus->nr_running = nr_cores;
+	sp_bus->cores = llsim_malloc(nr_cores * sizeof(sp_t *));
+	policy = llsim_get_param_str("bus_policy", "round_robin");
+	llsim_assert(strcmp(policy, "round_robin") == 0 || strcmp(policy, "priority") == 0,
+				 "ERROR: bus_policy must be round_robin or priority\n");
+	sp_bus->is_round_robin = strcmp(policy, "round_robin") == 0;
+	for (i = 0; i < nr_cores; i++) {
+		sprintf(name, "sp%d", i);
+		sprintf(param, "program%d", i);
+		sp_bus->cores[i] = sp_create_core(i, name, i ? llsim_get_param_str(param, program_name) : program_name);
+	}
+
+	bus_unit = llsim_register_unit("sramd_bus", sp_bus_run);
+	bus_regs = llsim_allocate_registers(bus_unit, "sramd_bus_registers", sizeof(int));
+	sp_bus->last_old = bus_regs->old;
+	sp_bus->last_new = bus_regs->new;
+	// round robin starts with core 0
+	llsim_register_register("sramd_bus", "last_grant", 8, nr_cores - 1, sp_bus->last_old, sp_bus->last_new);
+
+	sp_mbox = llsim_malloc(sizeof(sp_mbox_t));
+	sp_mbox->depth = llsim_get_param("mbox_depth", 4);
+	llsim_assert(sp_mbox->depth >= 1 && sp_mbox->depth <= 255, "ERROR: mbox_depth must be 1 to 255\n");
+	mbox_unit = llsim_register_unit("mailbox", sp_mbox_run);
+	mbox_regs = llsim_allocate_registers(mbox_unit, "mailbox_registers", nr_cores * (sp_mbox->depth + 2) * sizeof(int));
+	sp_mbox->old = mbox_regs->old;
+	sp_mbox->new = mbox_regs->new;
+	for (i = 0; i < nr_cores; i++) {
+		sprintf(name, "head%d", i);
+		llsim_register_register("mailbox", name, 8, 0, &MBOX_HEAD(sp_mbox->old, i), &MBOX_HEAD(sp_mbox->new, i));
+		sprintf(name, "count%d", i);
+		llsim_register_register("mailbox", name, 9, 0, &MBOX_COUNT(sp_mbox->old, i), &MBOX_COUNT(sp_mbox->new, i));
+		for (j = 0; j < sp_mbox->depth; j++) {
+			sprintf(name, "data%d_%d", i, j);
+			llsim_register_register("mailbox", name, 32, 0, &MBOX_DATA(sp_mbox->old, i, j), &MBOX_DATA(sp_mbox->new, i, j));
+		}
+	}
 
 	// c2v_translate_end
 }